@@ -5,14 +5,42 @@
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
-#include <lua.h>
-#include <lauxlib.h>
+#include <ctype.h>
+#include <limits.h>
 #include <time.h>
 #include <math.h>
 #include <locale.h>
+#ifdef __APPLE__
+#include <xlocale.h> // strftime_l
+#endif
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #include "datetimeformatter.h"
 
+#ifdef _WIN32
+// MinGW has neither newlocale nor mmap: names are rendered with the CRT
+// locales and snapshots are read into memory.
+typedef _locale_t locale_t;
+#define LC_TIME_MASK 0
+#define newlocale(mask, locale, base) _create_locale(LC_TIME, (locale))
+#define freelocale _free_locale
+#define strftime_l _strftime_l
+#define localtime_r(timer, result) (localtime_s((result), (timer)) == 0 ? (result) : NULL)
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static const char *patternChars = "GyMdkHmsSEDFwWahKzZYuXL";
+
 long floorDiv(long x, long y)
 {
     long r = x / y;
@@ -96,16 +124,139 @@ void add_buffer(buffer_t *B, buffer_t *C)
         add_char(B, another[i]);
 }
 
+void add_bytes(buffer_t *B, const char *s, size_t l)
+{
+    // Packs the bytes two per cell, so that they can be copied back in one go.
+    if (l == 0)
+    {
+        return;
+    }
+
+    assert(B->length + QUOTE_CELLS(l) <= B->size);
+
+    B->buffer[B->length + QUOTE_CELLS(l) - 1] = 0;
+    memcpy(B->buffer + B->length, s, l);
+    B->length += QUOTE_CELLS(l);
+}
+
+void init_strbuffer(strbuffer_t *B)
+{
+    B->size = STRBUFFER_INIT_SIZE;
+    B->length = 0;
+    B->buffer = B->init;
+}
+
+void free_strbuffer(strbuffer_t *B)
+{
+    if (B->buffer != B->init)
+    {
+        free(B->buffer);
+    }
+    init_strbuffer(B);
+}
+
+char *reserve_strbuffer(strbuffer_t *B, size_t n)
+{
+    if (B->size - B->length < n)
+    {
+        size_t size = B->size * 2;
+        while (size - B->length < n)
+        {
+            size *= 2;
+        }
+
+        char *b;
+        if (B->buffer == B->init)
+        {
+            b = (char *)malloc(size);
+            if (b != NULL)
+            {
+                memcpy(b, B->buffer, B->length);
+            }
+        }
+        else
+        {
+            b = (char *)realloc(B->buffer, size);
+        }
+
+        if (b == NULL)
+        {
+            return NULL;
+        }
+
+        B->buffer = b;
+        B->size = size;
+    }
+
+    return B->buffer + B->length;
+}
+
+void add_strchar(strbuffer_t *B, char c)
+{
+    if (B->length < B->size || reserve_strbuffer(B, 1) != NULL)
+    {
+        B->buffer[B->length++] = c;
+    }
+}
+
+void add_lstring(strbuffer_t *B, const char *s, size_t l)
+{
+    char *p = reserve_strbuffer(B, l);
+    if (p != NULL)
+    {
+        memcpy(p, s, l);
+        B->length += l;
+    }
+}
+
+void add_string(strbuffer_t *B, const char *s)
+{
+    add_lstring(B, s, strlen(s));
+}
+
+void add_integer(strbuffer_t *B, long value, int minDigits)
+{
+    char digits[24];
+    int n = 0;
+    unsigned long u = value < 0 ? -(unsigned long)value : (unsigned long)value;
+
+    do
+    {
+        digits[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+
+    if (value < 0)
+    {
+        add_strchar(B, '-');
+    }
+
+    for (int i = n; i < minDigits; i++)
+    {
+        add_strchar(B, '0');
+    }
+
+    char *p = reserve_strbuffer(B, n);
+    if (p != NULL)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            p[i] = digits[n - 1 - i];
+        }
+        B->length += n;
+    }
+}
+
 int triple_shift(int n, int s)
 {
     return n >= 0 ? n >> s : (n >> s) + (2 << ~s);
 }
 
-int encode(int tag, int length, buffer_t *buffer, char *error)
+int encode(int tag, int length, buffer_t *buffer, dtf_status_t *status)
 {
     if (tag == PATTERN_ISO_ZONE && length >= 4)
     {
-        sprintf(error, "invalid ISO 8601 format: length=%d", length);
+        *status = (dtf_status_t){DTF_ERROR_ISO_ZONE_LENGTH, -1, length};
         return 1;
     }
     if (length < 255)
@@ -122,21 +273,128 @@ int encode(int tag, int length, buffer_t *buffer, char *error)
     return 0;
 }
 
-int dtf_compile(const char *pattern, buffer_t **compiledCodeRef, char *error)
+int next_tag(buffer_t *compiledPattern, int i, int *tag, int *count)
+{
+    *tag = triple_shift(compiledPattern->buffer[i], 8);
+    *count = compiledPattern->buffer[i++] & 0xff;
+    if (*count == 255)
+    {
+        *count = compiledPattern->buffer[i++] << 16;
+        *count |= compiledPattern->buffer[i++];
+    }
+    return i;
+}
+
+bool is_day_invariant(int tag)
+{
+    switch (tag)
+    {
+    case PATTERN_ERA:
+    case PATTERN_YEAR:
+    case PATTERN_MONTH:
+    case PATTERN_DAY_OF_MONTH:
+    case PATTERN_DAY_OF_WEEK:
+    case PATTERN_DAY_OF_YEAR:
+    case PATTERN_DAY_OF_WEEK_IN_MONTH:
+    case PATTERN_WEEK_OF_YEAR:
+    case PATTERN_WEEK_OF_MONTH:
+    case PATTERN_WEEK_YEAR:
+    case PATTERN_ISO_DAY_OF_WEEK:
+    case PATTERN_MONTH_STANDALONE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+buffer_t *mark_day_segments(buffer_t *compiledCode)
+{
+    // Wraps every maximal run of date fields and literals, that contains at
+    // least one date field, in a TAG_DAY_SEGMENT whose count is the number of
+    // cells of the run, so that its rendering can be cached per local day.
+    buffer_t *marked = new_buffer(compiledCode->length * 2 + 3);
+    int tag = -1, count;
+    int start = 0, dated = 0;
+    bool invariant_field = false;
+
+    for (int i = 0; i <= compiledCode->length;)
+    {
+        int j = i < compiledCode->length ? next_tag(compiledCode, i, &tag, &count) : i;
+        bool literal = tag == TAG_QUOTE_ASCII_CHAR || tag == TAG_QUOTE_CHARS;
+        // A padding goes with the field before it.
+        bool invariant = tag == TAG_PAD ? invariant_field : is_day_invariant(tag);
+
+        if (i == compiledCode->length || !(literal || invariant))
+        {
+            if (dated)
+            {
+                encode(TAG_DAY_SEGMENT, i - start, marked, NULL);
+            }
+
+            for (int k = start; k < j; k++)
+            {
+                add_char(marked, compiledCode->buffer[k]);
+            }
+
+            start = j;
+            dated = 0;
+
+            if (i == compiledCode->length)
+            {
+                break;
+            }
+        }
+        else if (!literal)
+        {
+            dated++;
+        }
+
+        if (!literal && tag != TAG_PAD)
+        {
+            invariant_field = invariant;
+        }
+
+        if (tag == TAG_QUOTE_CHARS)
+        {
+            j += QUOTE_CELLS(count);
+        }
+
+        i = j;
+    }
+
+    return marked;
+}
+
+int encode_field(int tag, int count, buffer_t *compiledCode, int end, dtf_status_t *status)
+{
+    // The field of count letters ending before end.
+    if (encode(tag, count, compiledCode, status))
+    {
+        status->position = end - count;
+        return 1;
+    }
+    return 0;
+}
+
+int compile_pattern_status(const char *pattern, buffer_t **compiledCodeRef, dtf_status_t *status)
 {
+    // Nothing is formatted on failure and nothing allocated is left behind,
+    // a bad pattern compiled in a loop costs no memory.
     int length = strlen(pattern);
 
     bool inQuote = false;
 
     buffer_t *compiledCode = new_buffer(length * 2); // new StringBuilder(length * 2);
-    buffer_t *tmpBuffer = NULL;
+    strbuffer_t tmpBuffer;
+    init_strbuffer(&tmpBuffer);
 
     int count = 0;
     int lastTag = -1; //, prevTag = -1;
+    int quoteStart = 0;
 
     for (int i = 0; i < length; i++)
     {
-        char c = pattern[i];
+        unsigned char c = pattern[i];
 
         if (c == '\'')
         {
@@ -150,8 +408,8 @@ int dtf_compile(const char *pattern, buffer_t **compiledCodeRef, char *error)
                     i++;
                     if (count != 0)
                     {
-                        if (encode(lastTag, count, compiledCode, error))
-                            return 1;
+                        if (encode_field(lastTag, count, compiledCode, i - 1, status))
+                            goto failed;
 
                         // prevTag = lastTag;
                         lastTag = -1;
@@ -159,7 +417,7 @@ int dtf_compile(const char *pattern, buffer_t **compiledCodeRef, char *error)
                     }
                     if (inQuote)
                     {
-                        add_char(tmpBuffer, (char_t)c);
+                        add_strchar(&tmpBuffer, (char)c);
                     }
                     else
                     {
@@ -172,45 +430,29 @@ int dtf_compile(const char *pattern, buffer_t **compiledCodeRef, char *error)
             {
                 if (count != 0)
                 {
-                    if (encode(lastTag, count, compiledCode, error))
-                        return 1;
+                    if (encode_field(lastTag, count, compiledCode, i, status))
+                        goto failed;
 
                     // prevTag = lastTag;
                     lastTag = -1;
                     count = 0;
                 }
-                if (tmpBuffer == NULL)
-                {
-                    tmpBuffer = new_buffer(length); // new StringBuilder(length);
-                }
-                else
-                {
-                    tmpBuffer->length = 0; // tmpBuffer.setLength(0);
-                }
+                tmpBuffer.length = 0; // tmpBuffer.setLength(0);
                 inQuote = true;
+                quoteStart = i;
             }
             else
             {
-                int len = tmpBuffer->length;
-                if (len == 1)
+                int len = tmpBuffer.length;
+                if (len == 1 && (unsigned char)tmpBuffer.buffer[0] < 128)
                 {
-                    char_t ch = tmpBuffer->buffer[0];
-                    if (ch < 128)
-                    {
-                        add_char(compiledCode, (char_t)(TAG_QUOTE_ASCII_CHAR << 8 | ch));
-                    }
-                    else
-                    {
-                        add_char(compiledCode, (char_t)(TAG_QUOTE_CHARS << 8 | 1));
-                        add_char(compiledCode, ch);
-                    }
+                    add_char(compiledCode, (char_t)(TAG_QUOTE_ASCII_CHAR << 8 | (unsigned char)tmpBuffer.buffer[0]));
                 }
                 else
                 {
-                    if (encode(TAG_QUOTE_CHARS, len, compiledCode, error))
-                        return 1;
+                    encode(TAG_QUOTE_CHARS, len, compiledCode, status);
 
-                    add_buffer(compiledCode, tmpBuffer);
+                    add_bytes(compiledCode, tmpBuffer.buffer, len);
                 }
                 inQuote = false;
             }
@@ -218,15 +460,15 @@ int dtf_compile(const char *pattern, buffer_t **compiledCodeRef, char *error)
         }
         if (inQuote)
         {
-            add_char(tmpBuffer, (char_t)c);
+            add_strchar(&tmpBuffer, (char)c);
             continue;
         }
         if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
         {
             if (count != 0)
             {
-                if (encode(lastTag, count, compiledCode, error))
-                    return 1;
+                if (encode_field(lastTag, count, compiledCode, i, status))
+                    goto failed;
 
                 // prevTag = lastTag;
                 lastTag = -1;
@@ -240,35 +482,32 @@ int dtf_compile(const char *pattern, buffer_t **compiledCodeRef, char *error)
             else
             {
                 // Take any contiguous non-ASCII alphabet characters and
-                // put them in a single TAG_QUOTE_CHARS.
+                // put them in a single TAG_QUOTE_CHARS, as raw UTF-8 bytes.
                 int j;
                 for (j = i + 1; j < length; j++)
                 {
-                    char d = pattern[j];
+                    unsigned char d = pattern[j];
                     if (d == '\'' || ((d >= 'a' && d <= 'z') || (d >= 'A' && d <= 'Z')))
                     {
                         break;
                     }
                 }
 
-                if (encode(TAG_QUOTE_CHARS, j - i, compiledCode, error))
-                    return 1;
+                encode(TAG_QUOTE_CHARS, j - i, compiledCode, status);
 
-                for (; i < j; i++)
-                {
-                    add_char(compiledCode, (char_t)pattern[i]);
-                }
-                i--;
+                add_bytes(compiledCode, pattern + i, j - i);
+                i = j - 1;
             }
             continue;
         }
 
-        int tag = strchr(patternChars, c) - patternChars;
-        if (tag < 0)
+        const char *letter = strchr(patternChars, c);
+        if (letter == NULL)
         {
-            sprintf(error, "Illegal pattern character '%c'", c);
-            return 1;
+            *status = (dtf_status_t){DTF_ERROR_ILLEGAL_CHARACTER, i, c};
+            goto failed;
         }
+        int tag = letter - patternChars;
         if (lastTag == -1 || lastTag == tag)
         {
             lastTag = tag;
@@ -276,8 +515,8 @@ int dtf_compile(const char *pattern, buffer_t **compiledCodeRef, char *error)
             continue;
         }
 
-        if (encode(lastTag, count, compiledCode, error))
-            return 1;
+        if (encode_field(lastTag, count, compiledCode, i, status))
+            goto failed;
 
         // prevTag = lastTag;
         lastTag = tag;
@@ -286,705 +525,5000 @@ int dtf_compile(const char *pattern, buffer_t **compiledCodeRef, char *error)
 
     if (inQuote)
     {
-        sprintf(error, "Unterminated quote");
-        return 1;
+        *status = (dtf_status_t){DTF_ERROR_UNTERMINATED_QUOTE, quoteStart, 0};
+        goto failed;
     }
 
     if (count != 0)
     {
-        if (encode(lastTag, count, compiledCode, error))
-            return 1;
+        if (encode_field(lastTag, count, compiledCode, length, status))
+            goto failed;
 
         // prevTag = lastTag;
     }
 
-    free_buffer(tmpBuffer);
+    free_strbuffer(&tmpBuffer);
 
+    *status = (dtf_status_t){DTF_OK, -1, 0};
     *compiledCodeRef = compiledCode;
 
     return 0;
+
+failed:
+    free_buffer(compiledCode);
+    free_strbuffer(&tmpBuffer);
+
+    return 1;
 }
 
-int calendar_get(lua_State *L, tm_t tm, int field, int *v, char *output)
+int compile_pattern(const char *pattern, buffer_t **compiledCodeRef, char *error)
 {
-    *v = -1;
-    struct tm *info = tm.tm;
+    dtf_status_t status;
 
-    switch (field)
+    if (compile_pattern_status(pattern, compiledCodeRef, &status))
     {
-    case ERA:
-        *v = info->tm_year + 1900 >= 0 ? 1 : 0;
-        break;
-    case YEAR:
-        *v = info->tm_year + 1900;
-        break;
-    case MONTH:
-        *v = info->tm_mon;
-        break;
-    case df_DATE:
-        *v = info->tm_mday;
-        break;
-    case HOUR_OF_DAY:
-        *v = info->tm_hour;
-        break;
-    case MINUTE:
-        *v = info->tm_min;
-        break;
-    case SECOND:
-        *v = info->tm_sec;
-        break;
-    case MILLISECOND:
-        sprintf(output, "MILLISECOND calendar field isn't supported.");
-        return 1;
-    case DAY_OF_WEEK:
-        *v = info->tm_wday;
-        break;
-    case DAY_OF_YEAR:
-        *v = info->tm_yday + 1;
-        break;
-    case DAY_OF_WEEK_IN_MONTH:
-        sprintf(output, "DAY_OF_WEEK_IN_MONTH calendar field isn't supported.");
-        return 1;
-    case WEEK_OF_YEAR:
-        sprintf(output, "WEEK_OF_YEAR calendar field isn't supported.");
-        return 1;
-    case WEEK_OF_MONTH:
-        sprintf(output, "WEEK_OF_MONTH calendar field isn't supported.");
-        return 1;
-    case AM_PM:
-        *v = info->tm_hour < 12 ? 0 : 1;
-        break;
-    case HOUR:
-        *v = info->tm_hour % 12;
-        break;
-    case ZONE_OFFSET:
-        *v = tm.zone_offset;
-        break;
-    case WEEK_YEAR:
-        sprintf(output, "WEEK_YEAR calendar field isn't supported.");
-        return 1;
-    case ISO_DAY_OF_WEEK:
-        *v = info->tm_wday + 1;
-        break;
-    case DST_OFFSET:
-        *v = info->tm_isdst;
-        break;
-    default:
-        sprintf(output, "Generic calendar field %d isn't supported.", field);
+        dtf_status_message(&status, error, ERROR_BUFFER_LENGTH);
         return 1;
     }
     return 0;
 }
 
-// void calendar_getfield_at(lua_State *L, int date_table_index, const char *field, int value, char **current)
-// {
-//     lua_getfield(L, date_table_index, field);
-//     lua_len(L, -1);
-//     int length = lua_tointeger(L, -1);
-//     int n = 2; // 2 values to pop from the stack.
+void add_pattern_literal(strbuffer_t *pattern, bool *quoted, char c)
+{
+    // Letters are quoted, anything else is itself but a quote, that is
+    // doubled the same in and out of a quoted section.
+    bool letter = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
 
-//     if (value < length)
-//     {
-//         // current = eras[value];
-//         int lua_type = lua_geti(L, -2, value + 1);
-//         assert(lua_type == LUA_TSTRING);
-//         *current = (char *)lua_tostring(L, -1);
-//         n++; // one more string to be popped out.
-//     }
+    if (c == '\'')
+    {
+        add_string(pattern, "''");
+        return;
+    }
 
-//     lua_pop(L, n);
-// }
+    if (letter != *quoted)
+    {
+        add_strchar(pattern, '\'');
+        *quoted = letter;
+    }
+    add_strchar(pattern, c);
+}
 
-void sprintf0d(luaL_Buffer *sb, int value, int width)
+int dtf_compile_strftime(const char *format, buffer_t **compiledCodeRef, char *error)
 {
-    long d = value;
-    if (d < 0)
+    dtf_status_t status;
+
+    if (dtf_compile_strftime_status(format, compiledCodeRef, &status))
     {
-        luaL_addchar(sb, '-');
-        d = -d;
-        --width;
+        dtf_status_message(&status, error, ERROR_BUFFER_LENGTH);
+        return 1;
     }
-    int n = 10;
-    for (int i = 2; i < width; i++)
+    return 0;
+}
+
+int dtf_compile_strftime_status(const char *format, buffer_t **compiledCodeRef, dtf_status_t *status)
+{
+    // The strftime format is rewritten as the equivalent pattern, so that it
+    // compiles to the same code; conversions without one are errors. %y and
+    // %D are among them: "yy" prints the whole year out of 1000..9999, where
+    // strftime prints the year modulo 100.
+    strbuffer_t pattern;
+    init_strbuffer(&pattern);
+    bool quoted = false;
+
+    for (const char *p = format; *p != '\0'; p++)
     {
-        n *= 10;
+        const char *letters = NULL;
+
+        if (*p != '%')
+        {
+            add_pattern_literal(&pattern, &quoted, *p);
+            continue;
+        }
+
+        switch (*++p)
+        {
+        case 'a':
+            letters = "EEE";
+            break;
+        case 'A':
+            letters = "EEEE";
+            break;
+        case 'b':
+        case 'h':
+            letters = "MMM";
+            break;
+        case 'B':
+            letters = "MMMM";
+            break;
+        case 'd':
+            letters = "dd";
+            break;
+        case 'F':
+            letters = "y-MM-dd";
+            break;
+        case 'H':
+            letters = "HH";
+            break;
+        case 'I':
+            letters = "hh";
+            break;
+        case 'j':
+            letters = "DDD";
+            break;
+        case 'm':
+            letters = "MM";
+            break;
+        case 'M':
+            letters = "mm";
+            break;
+        case 'p':
+            letters = "a";
+            break;
+        case 'R':
+            letters = "HH:mm";
+            break;
+        case 'S':
+            letters = "ss";
+            break;
+        case 'T':
+            letters = "HH:mm:ss";
+            break;
+        case 'u':
+            letters = "u";
+            break;
+        case 'Y':
+            letters = "y";
+            break;
+        case 'z':
+            letters = "Z";
+            break;
+        case 'Z':
+            letters = "z";
+            break;
+        case 'n':
+            add_pattern_literal(&pattern, &quoted, '\n');
+            continue;
+        case 't':
+            add_pattern_literal(&pattern, &quoted, '\t');
+            continue;
+        case '%':
+            add_pattern_literal(&pattern, &quoted, '%');
+            continue;
+        default:
+            if (*p == '\0')
+                *status = (dtf_status_t){DTF_ERROR_STRFTIME_LONE_PERCENT, (int)(p - format) - 1, 0};
+            else
+                *status = (dtf_status_t){DTF_ERROR_STRFTIME_CONVERSION, (int)(p - format) - 1, *p};
+            free_strbuffer(&pattern);
+            return 1;
+        }
+
+        if (quoted)
+        {
+            add_strchar(&pattern, '\'');
+            quoted = false;
+        }
+        add_string(&pattern, letters);
     }
-    for (int i = 1; i < width && d < n; i++)
+
+    if (quoted)
     {
-        luaL_addchar(sb, '0');
-        n /= 10;
+        add_strchar(&pattern, '\'');
     }
-    luaL_addchar(sb, (char)d);
+    add_strchar(&pattern, '\0');
+
+    // Positions past this point are in the pattern, the format compiled to it.
+    int failed = dtf_compile_status(pattern.buffer, compiledCodeRef, status);
+
+    free_strbuffer(&pattern);
+
+    return failed;
 }
 
-int toISODayOfWeek(int calendarDayOfWeek)
+// The well-known patterns with a straight-line formatter and parser, by
+// KERNEL_* number; any pattern that compiles to the same code uses them.
+static const char *KERNEL_PATTERNS[KERNEL_COUNT] = {
+    NULL,
+    "yyyy-MM-dd'T'HH:mm:ss",           // KERNEL_ISO_SECONDS
+    "yyyy-MM-dd'T'HH:mm:ss.SSS",       // KERNEL_ISO_MILLIS
+    "yyyy-MM-dd'T'HH:mm:ssXXX",        // KERNEL_ISO_SECONDS_ZONE
+    "yyyy-MM-dd'T'HH:mm:ss.SSSXXX",    // KERNEL_ISO_MILLIS_ZONE
+    "EEE, dd MMM yyyy HH:mm:ss 'GMT'", // KERNEL_RFC1123
+    "dd/MMM/yyyy:HH:mm:ss Z",          // KERNEL_COMMON_LOG
+    "MMM d HH:mm:ss",                  // KERNEL_SYSLOG
+};
+
+static buffer_t *kernel_codes[KERNEL_COUNT];
+static pthread_once_t kernel_codes_once = PTHREAD_ONCE_INIT;
+
+void compile_kernel_codes(void)
 {
-    return calendarDayOfWeek == SUNDAY ? 7 : calendarDayOfWeek - 1;
+    char error[ERROR_BUFFER_LENGTH];
+
+    for (int k = 1; k < KERNEL_COUNT; k++)
+    {
+        if (compile_pattern(KERNEL_PATTERNS[k], kernel_codes + k, error))
+        {
+            kernel_codes[k] = NULL;
+        }
+    }
 }
 
-static const int LEAST_MAX_VALUES[] = {
-    1,         // ERA
-    292269054, // YEAR
-    DECEMBER,  // MONTH
-    52,        // WEEK_OF_YEAR
-    4,         // WEEK_OF_MONTH
-    28,        // DAY_OF_MONTH
-    365,       // DAY_OF_YEAR
-    SATURDAY,  // DAY_OF_WEEK
-    4,         // DAY_OF_WEEK_IN
-    PM,        // AM_PM
-    11,        // HOUR
-    23,        // HOUR_OF_DAY
-    59,        // MINUTE
-    59,        // SECOND
-    999,       // MILLISECOND
-    // ZONE_OFFSET, // ZONE_OFFSET
-    // DST_OFFSET,   // DST_OFFSET (historical least maximum)
-};
+int find_kernel(buffer_t *compiledCode)
+{
+    pthread_once(&kernel_codes_once, compile_kernel_codes);
 
-static const int MAX_VALUES[] = {
-    1,         // ERA
-    292278994, // YEAR
-    DECEMBER,  // MONTH
-    53,        // WEEK_OF_YEAR
-    6,         // WEEK_OF_MONTH
-    31,        // DAY_OF_MONTH
-    366,       // DAY_OF_YEAR
-    SATURDAY,  // DAY_OF_WEEK
-    6,         // DAY_OF_WEEK_IN
-    PM,        // AM_PM
-    11,        // HOUR
-    23,        // HOUR_OF_DAY
-    59,        // MINUTE
-    59,        // SECOND
-    999,       // MILLISECOND
-    // 14 * ONE_HOUR, // ZONE_OFFSET
-    // 2 * ONE_HOUR   // DST_OFFSET (double summer time)
-};
+    for (int k = 1; k < KERNEL_COUNT; k++)
+    {
+        buffer_t *code = kernel_codes[k];
+        if (code != NULL && code->length == compiledCode->length &&
+            memcmp(code->buffer, compiledCode->buffer, code->length * sizeof(char_t)) == 0)
+        {
+            return k;
+        }
+    }
+    return 0;
+}
 
-int calendar_getLeastMaximum(int i) { return LEAST_MAX_VALUES[i]; }
+size_t dtf_status_message(const dtf_status_t *status, char *buffer, size_t size)
+{
+    // The message of the status, cut to size bytes with the terminating
+    // '\0'; the length it would have, as snprintf.
+    switch (status->code)
+    {
+    case DTF_OK:
+        return snprintf(buffer, size, "No error");
+    case DTF_ERROR_ILLEGAL_CHARACTER:
+        return snprintf(buffer, size, "Illegal pattern character '%c'", status->detail);
+    case DTF_ERROR_UNTERMINATED_QUOTE:
+        return snprintf(buffer, size, "Unterminated quote");
+    case DTF_ERROR_ISO_ZONE_LENGTH:
+        return snprintf(buffer, size, "invalid ISO 8601 format: length=%d", status->detail);
+    case DTF_ERROR_STRFTIME_CONVERSION:
+        return snprintf(buffer, size, "The strftime conversion %%%c isn't supported.", status->detail);
+    case DTF_ERROR_STRFTIME_LONE_PERCENT:
+        return snprintf(buffer, size, "The strftime format ends with a lone '%%'.");
+    default:
+        return snprintf(buffer, size, "Unknown error %d", (int)status->code);
+    }
+}
 
-int calendar_getMaximum(int i) { return MAX_VALUES[i]; }
+int dtf_compile(const char *pattern, buffer_t **compiledCodeRef, char *error)
+{
+    dtf_status_t status;
+
+    if (dtf_compile_status(pattern, compiledCodeRef, &status))
+    {
+        dtf_status_message(&status, error, ERROR_BUFFER_LENGTH);
+        return 1;
+    }
+    return 0;
+}
 
-void zeroPaddingNumber(lua_State *L, int value, int minDigits, int maxDigits, luaL_Buffer *buffer)
+int dtf_compile_status(const char *pattern, buffer_t **compiledCodeRef, dtf_status_t *status)
 {
-    // Optimization for 1, 2 and 4 digit numbers. This should
-    // cover most cases of formatting date/time related items.
-    // Note: This optimization code assumes that maxDigits is
-    // either 2 or Integer.MAX_VALUE (maxIntCount in format()).
+    buffer_t *compiledCode;
 
-    // try
+    if (compile_pattern_status(pattern, &compiledCode, status))
     {
-        char zeroDigit = 0;
-        if (zeroDigit == 0)
-        {
-            // zeroDigit = ((DecimalFormat)numberFormat).getDecimalFormatSymbols().getZeroDigit();
-            zeroDigit = '0';
-        }
-        if (value >= 0)
+        return 1;
+    }
+
+    buffer_t *marked = mark_day_segments(compiledCode);
+    int kernel = find_kernel(compiledCode);
+
+    free_buffer(compiledCode);
+
+    if (kernel)
+    {
+        // A leading TAG_KERNEL, the generic code follows for everything it can't do.
+        buffer_t *code = new_buffer(marked->length + 1);
+        add_char(code, (char_t)(TAG_KERNEL << 8 | kernel));
+        add_buffer(code, marked);
+        free_buffer(marked);
+        marked = code;
+    }
+
+    *compiledCodeRef = marked;
+
+    return 0;
+}
+
+// Digits of the largest value of the numeric fields, 0 for the names and zones.
+static const int PATTERN_MAX_DIGITS[] = {
+    0, // G
+    4, // y, in [1, 9999]
+    2, // M
+    2, // d
+    2, // k
+    2, // H
+    2, // m
+    2, // s
+    3, // S
+    0, // E
+    3, // D
+    1, // F
+    2, // w
+    1, // W
+    0, // a
+    2, // h
+    2, // K
+    0, // z
+    0, // Z
+    4, // Y, in [1, 9999]
+    1, // u
+    0, // X
+    2, // L
+};
+
+static const resolution_t PATTERN_RESOLUTION[] = {
+    RESOLUTION_YEAR,        // G
+    RESOLUTION_YEAR,        // y
+    RESOLUTION_MONTH,       // M
+    RESOLUTION_DAY,         // d
+    RESOLUTION_HOUR,        // k
+    RESOLUTION_HOUR,        // H
+    RESOLUTION_MINUTE,      // m
+    RESOLUTION_SECOND,      // s
+    RESOLUTION_MILLISECOND, // S
+    RESOLUTION_DAY,         // E
+    RESOLUTION_DAY,         // D
+    RESOLUTION_DAY,         // F
+    RESOLUTION_DAY,         // w
+    RESOLUTION_DAY,         // W
+    RESOLUTION_HOUR,        // a
+    RESOLUTION_HOUR,        // h
+    RESOLUTION_HOUR,        // K
+    RESOLUTION_NONE,        // z
+    RESOLUTION_NONE,        // Z
+    RESOLUTION_YEAR,        // Y
+    RESOLUTION_DAY,         // u
+    RESOLUTION_NONE,        // X
+    RESOLUTION_MONTH,       // L
+};
+
+int dtf_pattern_info(buffer_t *compiledPattern, dtf_pattern_info_t *info, char *output)
+{
+    memset(info, 0, sizeof(dtf_pattern_info_t));
+    info->resolution = RESOLUTION_NONE;
+    size_t field_min = 0, field_max = 0;
+
+    for (int i = 0; i < compiledPattern->length;)
+    {
+        int tag, count;
+        i = next_tag(compiledPattern, i, &tag, &count);
+
+        size_t min, max;
+
+        switch (tag)
         {
-            if (value < 100 && minDigits >= 1 && minDigits <= 2)
+        case TAG_DAY_SEGMENT:
+        case TAG_KERNEL:
+            continue; // transparent, the generic code follows.
+
+        case TAG_PAD:
+            // The field before takes exactly count bytes.
+            info->min_length += count - field_min;
+            info->max_length += count - field_max;
+            continue;
+
+        case TAG_QUOTE_ASCII_CHAR:
+            min = max = 1;
+            break;
+
+        case TAG_QUOTE_CHARS:
+            min = max = count;
+            i += QUOTE_CELLS(count);
+            break;
+
+        case PATTERN_ERA:
+        case PATTERN_DAY_OF_WEEK:
+        case PATTERN_AM_PM:
+            min = 0;
+            max = NAME_LENGTH - 1;
+            info->locale_dependent = true;
+            break;
+
+        case PATTERN_MONTH:
+        case PATTERN_MONTH_STANDALONE:
+            if (count >= 3)
             {
-                if (value < 10)
-                {
-                    if (minDigits == 2)
-                    {
-                        luaL_addchar(buffer, zeroDigit);
-                    }
-                    luaL_addchar(buffer, (char)(zeroDigit + value));
-                }
-                else
-                {
-                    luaL_addchar(buffer, (char)(zeroDigit + value / 10));
-                    luaL_addchar(buffer, (char)(zeroDigit + value % 10));
-                }
-                return;
+                min = 0;
+                max = NAME_LENGTH - 1;
+                info->locale_dependent = true;
+                break;
             }
-            else if (value >= 1000 && value < 10000)
+            min = count;
+            max = count > 2 ? count : 2;
+            break;
+
+        case PATTERN_ZONE_NAME:
+            min = 0;
+            max = ZONE_NAME_LENGTH - 1;
+            info->zone_dependent = true;
+            break;
+
+        case PATTERN_ZONE_VALUE:
+            min = max = 5;
+            info->zone_dependent = true;
+            break;
+
+        case PATTERN_ISO_ZONE:
+            min = 1; // "Z"
+            max = count == 1 ? 3 : count == 2 ? 5 : 6;
+            info->zone_dependent = true;
+            break;
+
+        case PATTERN_YEAR:
+        case PATTERN_WEEK_YEAR:
+            if (count == 2)
             {
-                if (minDigits == 4)
-                {
-                    luaL_addchar(buffer, (char)(zeroDigit + value / 1000));
-                    value %= 1000;
-                    luaL_addchar(buffer, (char)(zeroDigit + value / 100));
-                    value %= 100;
-                    luaL_addchar(buffer, (char)(zeroDigit + value / 10));
-                    luaL_addchar(buffer, (char)(zeroDigit + value % 10));
-                    return;
-                }
-                if (minDigits == 2 && maxDigits == 2)
-                {
-                    zeroPaddingNumber(L, value % 100, 2, 2, buffer);
-                    return;
-                }
+                // Clipped to two digits in 1000..9999 only, years below
+                // print in full: "05", "132".
+                min = 2;
+                max = 3;
+                break;
+            }
+            // fall through
+        default:
+            if (tag < 0 || tag > PATTERN_MONTH_STANDALONE)
+            {
+                snprintf(output, ERROR_BUFFER_LENGTH, "Unknown tag %d in the compiled pattern", tag);
+                return 1;
+            }
+            min = count;
+            max = count > PATTERN_MAX_DIGITS[tag] ? count : PATTERN_MAX_DIGITS[tag];
+            break;
+        }
+
+        if (tag <= PATTERN_MONTH_STANDALONE)
+        {
+            info->fields |= 1u << tag;
+            if (PATTERN_RESOLUTION[tag] < info->resolution)
+            {
+                info->resolution = PATTERN_RESOLUTION[tag];
             }
         }
+
+        info->min_length += min;
+        info->max_length += max;
+        field_min = min;
+        field_max = max;
     }
-    // catch (Exception e)
-    // {
-    // }
 
-    // numberFormat.setMinimumIntegerDigits(minDigits);
-    // numberFormat.setMaximumIntegerDigits(maxDigits);
-    // numberFormat.format((long)value, buffer, DontCareFieldPosition.INSTANCE);
-    lua_pushinteger(L, value);
-    luaL_addvalue(buffer);
+    info->fixed_width = info->min_length == info->max_length;
+
+    return 0;
 }
 
-int subFormat(lua_State *L, tm_t tm, int patternCharIndex, int count, luaL_Buffer *buffer, char *output)
+long days_from_civil(long y, int m, int d)
 {
-    struct tm *info = tm.tm;
-    // int lua_type;
-    char strftime_buffer[STRFTIME_BUFFER_LENGTH];
-
-    int maxIntCount = INT_MAX;
-    char *current = NULL;
-    // int beginOffset = luaL_bufflen(buffer);
+    // Days since 1970-01-01 of the proleptic Gregorian date y-m-d, where m is in 1..12;
+    // years are shifted to start in March so that the leap day is the last of the year.
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    long yoe = y - era * 400;                                      // [0, 399]
+    long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;    // [0, 365]
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;              // [0, 146096]
+    return era * 146097 + doe - 719468;
+}
 
-    int field = PATTERN_INDEX_TO_CALENDAR_FIELD[patternCharIndex];
-    int value;
-    int failed = 0;
+void civil_from_days(long days, long *y, int *m, int *d)
+{
+    // The inverse of days_from_civil, m is in 1..12.
+    days += 719468;
+    long era = (days >= 0 ? days : days - 146096) / 146097;
+    long doe = days - era * 146097;                                  // [0, 146096]
+    long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365; // [0, 399]
+    long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);              // [0, 365]
+    long mp = (5 * doy + 2) / 153;                                   // [0, 11], from March
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = yoe + era * 400 + (*m <= 2);
+}
 
-    int zone_o, dst_o;
+void civil_step(long *y, int *m, int *d, int delta)
+{
+    // The civil date one day after y-m-d when delta is 1, one day before when -1.
+    static const int lengths[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int leap = *y % 4 == 0 && (*y % 100 != 0 || *y % 400 == 0);
 
-    if (field == WEEK_YEAR)
+    if (delta > 0)
     {
-        // if (calendar.isWeekDateSupported())
-        // lua_type = lua_getfield(L, date_table_index, "isWeekDateSupported");
-        // if (lua_type == LUA_TBOOLEAN && lua_toboolean(L, -1))
-        // {
-        //     // value = calendar.getWeekYear();
-        //     lua_type = lua_getfield(L, date_table_index, "getWeekYear");
-        //     assert(lua_type == LUA_TNUMBER);
-        //     value = lua_tointeger(L, -1);
-        //     lua_pop(L, 1);
-        // }
-        // else
+        if (*d < lengths[*m - 1] + (*m == 2 && leap))
         {
-            // use calendar year 'y' instead
-            patternCharIndex = PATTERN_YEAR;
-            field = PATTERN_INDEX_TO_CALENDAR_FIELD[patternCharIndex];
-            failed = calendar_get(L, tm, field, &value, output);
-            if (failed)
-                return failed;
+            (*d)++;
+            return;
+        }
+        *d = 1;
+        if (++*m > 12)
+        {
+            *m = 1;
+            (*y)++;
         }
-        // lua_pop(L, 1);
     }
-    else if (field == ISO_DAY_OF_WEEK)
+    else if (delta < 0)
     {
-        failed = calendar_get(L, tm, DAY_OF_WEEK, &value, output);
-        if (failed)
-            return failed;
+        if (*d > 1)
+        {
+            (*d)--;
+            return;
+        }
+        if (--*m < 1)
+        {
+            *m = 12;
+            (*y)--;
+        }
+        *d = lengths[*m - 1] + (*m == 2 && leap);
+    }
+}
 
-        value = toISODayOfWeek(value);
+void calendar_resolve(tm_t *tm)
+{
+    // The civil date of the local day, only when a date field asks for it;
+    // the day of week and the time of day fields don't need it.
+    if (!tm->civil)
+    {
+        civil_from_days(tm->day, &tm->year, &tm->month, &tm->mday);
+        tm->civil = 1;
     }
-    else
+}
+
+int calendar_get(tm_t *tm, int field, int *v, char *output)
+{
+    *v = -1;
+
+    // Time of day fields come straight from the seconds within the local day.
+    switch (field)
     {
-        failed = calendar_get(L, tm, field, &value, output);
-        if (failed)
-            return failed;
+    case HOUR_OF_DAY:
+        *v = tm->seconds / 3600;
+        return 0;
+    case MINUTE:
+        *v = tm->seconds / 60 % 60;
+        return 0;
+    case SECOND:
+        *v = tm->seconds % 60;
+        return 0;
+    case AM_PM:
+        *v = tm->seconds < 12 * 3600 ? 0 : 1;
+        return 0;
+    case HOUR:
+        *v = tm->seconds / 3600 % 12;
+        return 0;
+    case MILLISECOND:
+        *v = tm->nanos / 1000000;
+        return 0;
+    case ZONE_OFFSET:
+        *v = tm->zone_offset;
+        return 0;
     }
 
-    // int style = (count >= 4) ? LONG_C : SHORT_C;
-    // if (!useDateFormatSymbols && field < ZONE_OFFSET && patternCharIndex != PATTERN_MONTH_STANDALONE)
-    // {
-    //     current = calendar.getDisplayName(field, style, locale);
-    // }
+    switch (field)
+    {
+    case DAY_OF_WEEK:
+        *v = (int)floorMod(tm->day + 4, 7); // as tm_wday, 1970-01-01 is a Thursday.
+        return 0;
+    case ISO_DAY_OF_WEEK:
+        *v = (int)floorMod(tm->day + 3, 7) + 1; // Monday 1 to Sunday 7.
+        return 0;
+    case DST_OFFSET:
+        *v = tm->isdst > 0;
+        return 0;
+    }
 
-    // Note: zeroPaddingNumber(L, ) assumes that maxDigits is either
-    // 2 or maxIntCount. If we make any changes to this,
-    // zeroPaddingNumber(L, ) must be fixed.
+    calendar_resolve(tm);
 
-    switch (patternCharIndex)
+    switch (field)
     {
-    case PATTERN_ERA: // 'G'
-        // if (useDateFormatSymbols)
-        {
-            // const char **eras = formatData.getEras();
-            // calendar_getfield_at(L, date_table_index, "getEras", value, &current);
-            // current = eras[value];
-        }
-        if (current == NULL)
-        {
-            current = "";
-        }
+    case ERA:
+        *v = tm->year >= 0 ? 1 : 0;
         break;
-
-    case PATTERN_WEEK_YEAR: // 'Y'
-    case PATTERN_YEAR:      // 'y'
-        // lua_type = lua_getfield(L, date_table_index, "isGregorianCalendar");
-        // if (lua_type == LUA_TBOOLEAN && lua_toboolean(L, -1))
-        {
-            if (count != 2)
-            {
-                zeroPaddingNumber(L, value, count, maxIntCount, buffer);
-            }
-            else
-            {
-                zeroPaddingNumber(L, value, 2, 2, buffer);
-            } // clip 1996 to 96
-        }
-        // else
-        // {
-        //     if (current == NULL)
-        //     {
-        //         zeroPaddingNumber(L, value, style == LONG_C ? 1 : count, maxIntCount, buffer);
-        //     }
-        // }
-        // lua_pop(L, 1);
+    case YEAR:
+        *v = (int)tm->year;
         break;
+    case MONTH:
+        *v = tm->month - 1;
+        break;
+    case df_DATE:
+        *v = tm->mday;
+        break;
+    case DAY_OF_YEAR:
+        *v = (int)(tm->day - days_from_civil(tm->year, 1, 1)) + 1;
+        break;
+    case DAY_OF_WEEK_IN_MONTH:
+        snprintf(output, ERROR_BUFFER_LENGTH, "DAY_OF_WEEK_IN_MONTH calendar field isn't supported.");
+        return 1;
+    case WEEK_OF_YEAR:
+        snprintf(output, ERROR_BUFFER_LENGTH, "WEEK_OF_YEAR calendar field isn't supported.");
+        return 1;
+    case WEEK_OF_MONTH:
+        snprintf(output, ERROR_BUFFER_LENGTH, "WEEK_OF_MONTH calendar field isn't supported.");
+        return 1;
+    case WEEK_YEAR:
+        snprintf(output, ERROR_BUFFER_LENGTH, "WEEK_YEAR calendar field isn't supported.");
+        return 1;
+    default:
+        snprintf(output, ERROR_BUFFER_LENGTH, "Generic calendar field %d isn't supported.", field);
+        return 1;
+    }
+    return 0;
+}
+
+// void calendar_getfield_at(int date_table_index, const char *field, int value, char **current)
+// {
+//     lua_getfield(L, date_table_index, field);
+//     lua_len(L, -1);
+//     int length = lua_tointeger(L, -1);
+//     int n = 2; // 2 values to pop from the stack.
+
+//     if (value < length)
+//     {
+//         // current = eras[value];
+//         int lua_type = lua_geti(L, -2, value + 1);
+//         assert(lua_type == LUA_TSTRING);
+//         *current = (char *)lua_tostring(L, -1);
+//         n++; // one more string to be popped out.
+//     }
+
+//     lua_pop(L, n);
+// }
+
+int local_offset(struct tm *info, time_t timer)
+{
+    long local = days_from_civil(info->tm_year + 1900L, info->tm_mon + 1, info->tm_mday) * 86400L +
+                 info->tm_hour * 3600L + info->tm_min * 60L + info->tm_sec;
+
+    return (int)(local - (long)timer);
+}
+
+static _Thread_local zone_period_t local_zone_cache;
+static _Thread_local unsigned local_zone_cache_generation;
+static atomic_uint local_zone_generation;
+
+int zone_period_probe(time_t timer, zone_period_t *period)
+{
+    struct tm info;
+
+    if (localtime_r(&timer, &info) == NULL)
+    {
+        return 1;
+    }
+
+    period->offset = local_offset(&info, timer);
+    period->isdst = info.tm_isdst;
+    if (strftime(period->name, ZONE_NAME_LENGTH, "%Z", &info) == 0)
+    {
+        period->name[0] = '\0'; // an empty name if the abbreviation doesn't fit.
+    }
+    return 0;
+}
+
+bool same_zone_period(const zone_period_t *a, const zone_period_t *b)
+{
+    return a->offset == b->offset && a->isdst == b->isdst && strcmp(a->name, b->name) == 0;
+}
+
+time_t zone_transition(time_t from, time_t to, const zone_period_t *period)
+{
+    // The first second in (from, to] out of the period of from, to being out of it.
+    zone_period_t probe;
+
+    while (to - from > 1)
+    {
+        time_t middle = from + (to - from) / 2;
+        if (zone_period_probe(middle, &probe) == 0 && same_zone_period(&probe, period))
+        {
+            from = middle;
+        }
+        else
+        {
+            to = middle;
+        }
+    }
+    return to;
+}
+
+const zone_period_t *local_zone_period(time_t timer)
+{
+    // The local zone keeps its offset for months, so the period around the
+    // last instant is remembered and instants in it need no localtime call.
+    // Transitions are assumed at least ZONE_PERIOD_PROBE seconds apart.
+    zone_period_t *cached = &local_zone_cache;
+    unsigned generation = atomic_load_explicit(&local_zone_generation, memory_order_acquire);
+
+    if (timer >= cached->start && timer < cached->end && local_zone_cache_generation == generation)
+    {
+        return cached;
+    }
+
+    if (local_zone_cache_generation != generation)
+    {
+        cached->start = cached->end = 0; // the zone was changed, nothing is known.
+        local_zone_cache_generation = generation;
+    }
+
+    zone_period_t period, probe;
+
+    if (zone_period_probe(timer, &period))
+    {
+        return NULL;
+    }
+
+    bool known = cached->start < cached->end && same_zone_period(cached, &period);
+
+    if (known && timer >= cached->end && timer - cached->end < ZONE_PERIOD_PROBE)
+    {
+        period.start = cached->start; // right after the cached period.
+    }
+    else if (zone_period_probe(timer - ZONE_PERIOD_PROBE, &probe) == 0 && !same_zone_period(&probe, &period))
+    {
+        period.start = zone_transition(timer - ZONE_PERIOD_PROBE, timer, &probe);
+    }
+    else
+    {
+        period.start = timer - ZONE_PERIOD_PROBE;
+    }
+
+    if (known && timer < cached->start && cached->start - timer <= ZONE_PERIOD_PROBE)
+    {
+        period.end = cached->end; // right before the cached period.
+    }
+    else if (zone_period_probe(timer + ZONE_PERIOD_PROBE, &probe) == 0 && same_zone_period(&probe, &period))
+    {
+        period.end = timer + ZONE_PERIOD_PROBE + 1;
+    }
+    else
+    {
+        period.end = zone_transition(timer, timer + ZONE_PERIOD_PROBE, &period);
+    }
+
+    *cached = period;
+    return cached;
+}
+
+void dtf_zone_reset(void)
+{
+    // The caches of every thread are stale once the counter moves.
+    tzset();
+    atomic_fetch_add_explicit(&local_zone_generation, 1, memory_order_release);
+}
+
+int local_offset_at(time_t timer, int fallback)
+{
+    const zone_period_t *period = local_zone_period(timer);
+    return period != NULL ? period->offset : fallback;
+}
+
+time_t local_to_utc(time_t local, int isdst, int fallback, int *zone_offset)
+{
+    // The instant at which the local zone shows the local time: the offsets
+    // a probe before and after it are tried, the one in force then wins.
+    // As mktime does, a time repeated when the clocks go back is the first
+    // one, unless isdst asks for the other, and a time skipped when they go
+    // forward is taken with the offset before, so that it lands after.
+    const zone_period_t *around = local_zone_period(local);
+
+    if (around != NULL && around->start <= local - ZONE_PERIOD_PROBE && local + ZONE_PERIOD_PROBE < around->end)
+    {
+        // No transition near, the usual case and one lookup.
+        *zone_offset = around->offset;
+        return local - around->offset;
+    }
+
+    int early = local_offset_at(local - ZONE_PERIOD_PROBE, fallback);
+    int late = local_offset_at(local + ZONE_PERIOD_PROBE, fallback);
+    time_t timer = local - early;
+
+    if (early != late)
+    {
+        bool early_valid = local_offset_at(local - early, fallback) == early;
+        bool late_valid = local_offset_at(local - late, fallback) == late;
+
+        const zone_period_t *period = local_zone_period(local - late);
+        bool late_dst = period != NULL && period->isdst > 0;
+
+        if (late_valid && (!early_valid || (isdst >= 0 && late_dst == (isdst > 0))))
+        {
+            timer = local - late;
+        }
+    }
+
+    *zone_offset = local_offset_at(timer, fallback);
+    return timer;
+}
+
+time_t dtf_timegm(const struct tm *tm)
+{
+    // Lenient as timegm: months, days and times out of their ranges carry
+    // over, tm_wday and tm_yday are ignored and tm is left as is.
+    long year = tm->tm_year + 1900L + floorDiv(tm->tm_mon, 12);
+    int month = (int)floorMod(tm->tm_mon, 12) + 1;
+    long days = days_from_civil(year, month, 1) + tm->tm_mday - 1;
+
+    return (time_t)(days * 86400L + tm->tm_hour * 3600L + tm->tm_min * 60L + tm->tm_sec);
+}
+
+static inline time_t dtf_mktime_offset(const struct tm *tm, int offset, int local, int *zone_offset)
+{
+    time_t seconds = dtf_timegm(tm);
+
+    if (local)
+    {
+        return local_to_utc(seconds, tm->tm_isdst, offset, zone_offset);
+    }
+
+    *zone_offset = offset;
+    return seconds - offset;
+}
+
+time_t dtf_mktime(const struct tm *tm, int offset, int local, int *zone_offset)
+{
+    // As mktime with the local zone when local is set, else with the fixed
+    // offset; the offset in force goes to zone_offset unless it's NULL.
+    int in_force;
+    time_t timer = dtf_mktime_offset(tm, offset, local, &in_force);
+
+    if (zone_offset != NULL)
+    {
+        *zone_offset = in_force;
+    }
+    return timer;
+}
+
+void dtf_mktime_batch(const struct tm *tms, size_t n, int offset, int local, time_t *timers, int *zone_offsets)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        int in_force;
+        timers[i] = dtf_mktime_offset(tms + i, offset, local, &in_force);
+
+        if (zone_offsets != NULL)
+        {
+            zone_offsets[i] = in_force;
+        }
+    }
+}
+
+static _Thread_local zone_strings_t zone_strings_cache[ZONE_STRINGS_CACHE_SIZE];
+static _Thread_local int zone_strings_cache_used = 0;
+static _Thread_local int zone_strings_cache_next = 0;
+
+void render_zone_strings(zone_strings_t *z, int offset, const char *name, size_t name_length)
+{
+    int minutes = offset / 60;
+    char sign = '+';
+
+    if (minutes < 0)
+    {
+        sign = '-';
+        minutes = -minutes;
+    }
+
+    int hh = minutes / 60 % 100, mm = minutes % 60;
+
+    // "+hhmm", the 'Z' form.
+    z->rfc822[0] = sign;
+    z->rfc822[1] = (char)('0' + hh / 10);
+    z->rfc822[2] = (char)('0' + hh % 10);
+    z->rfc822[3] = (char)('0' + mm / 10);
+    z->rfc822[4] = (char)('0' + mm % 10);
+
+    // "+hh", "+hhmm" and "+hh:mm", the 'X', 'XX' and 'XXX' forms, "Z" for UTC.
+    if (minutes == 0)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            z->iso8601[i][0] = 'Z';
+            z->iso8601_length[i] = 1;
+        }
+    }
+    else
+    {
+        memcpy(z->iso8601[0], z->rfc822, 3);
+        z->iso8601_length[0] = 3;
+
+        memcpy(z->iso8601[1], z->rfc822, 5);
+        z->iso8601_length[1] = 5;
+
+        memcpy(z->iso8601[2], z->rfc822, 3);
+        z->iso8601[2][3] = ':';
+        memcpy(z->iso8601[2] + 4, z->rfc822 + 3, 2);
+        z->iso8601_length[2] = 6;
+    }
+
+    z->offset = offset;
+    z->name_length = name_length;
+    if (name_length < ZONE_NAME_LENGTH)
+    {
+        memcpy(z->name_init, name, name_length);
+        z->name_init[name_length] = '\0';
+        z->name = z->name_init;
+    }
+    else
+    {
+        z->name = name; // too long to be cached, it borrows the caller's string.
+    }
+}
+
+const zone_strings_t *zone_strings(tm_t *tm, zone_strings_t *scratch)
+{
+    int offset = tm->zone_offset;
+    int isdst = tm->isdst;
+
+    for (int i = 0; i < zone_strings_cache_used; i++)
+    {
+        zone_strings_t *z = zone_strings_cache + i;
+
+        if (z->offset == offset && z->isdst == isdst && z->localtime == tm->localtime &&
+            strcmp(z->name, tm->zone_name) == 0)
+        {
+            return z;
+        }
+    }
+
+    // The abbreviation of the local zone comes from its offset period.
+    const char *name = tm->zone_name;
+    size_t name_length = strlen(name);
+
+    zone_strings_t *z = scratch;
+
+    if (name_length < ZONE_NAME_LENGTH)
+    {
+        z = zone_strings_cache + zone_strings_cache_next;
+        zone_strings_cache_next = (zone_strings_cache_next + 1) % ZONE_STRINGS_CACHE_SIZE;
+        if (zone_strings_cache_used < ZONE_STRINGS_CACHE_SIZE)
+        {
+            zone_strings_cache_used++;
+        }
+    }
+
+    render_zone_strings(z, offset, name, name_length);
+    z->isdst = isdst;
+    z->localtime = tm->localtime;
+
+    return z;
+}
+
+int toISODayOfWeek(int calendarDayOfWeek)
+{
+    return calendarDayOfWeek == SUNDAY ? 7 : calendarDayOfWeek - 1;
+}
+
+static const int LEAST_MAX_VALUES[] = {
+    1,         // ERA
+    292269054, // YEAR
+    DECEMBER,  // MONTH
+    52,        // WEEK_OF_YEAR
+    4,         // WEEK_OF_MONTH
+    28,        // DAY_OF_MONTH
+    365,       // DAY_OF_YEAR
+    SATURDAY,  // DAY_OF_WEEK
+    4,         // DAY_OF_WEEK_IN
+    PM,        // AM_PM
+    11,        // HOUR
+    23,        // HOUR_OF_DAY
+    59,        // MINUTE
+    59,        // SECOND
+    999,       // MILLISECOND
+    // ZONE_OFFSET, // ZONE_OFFSET
+    // DST_OFFSET,   // DST_OFFSET (historical least maximum)
+};
+
+static const int MAX_VALUES[] = {
+    1,         // ERA
+    292278994, // YEAR
+    DECEMBER,  // MONTH
+    53,        // WEEK_OF_YEAR
+    6,         // WEEK_OF_MONTH
+    31,        // DAY_OF_MONTH
+    366,       // DAY_OF_YEAR
+    SATURDAY,  // DAY_OF_WEEK
+    6,         // DAY_OF_WEEK_IN
+    PM,        // AM_PM
+    11,        // HOUR
+    23,        // HOUR_OF_DAY
+    59,        // MINUTE
+    59,        // SECOND
+    999,       // MILLISECOND
+    // 14 * ONE_HOUR, // ZONE_OFFSET
+    // 2 * ONE_HOUR   // DST_OFFSET (double summer time)
+};
+
+int calendar_getLeastMaximum(int i) { return LEAST_MAX_VALUES[i]; }
+
+int calendar_getMaximum(int i) { return MAX_VALUES[i]; }
+
+void zeroPaddingNumber(int value, int minDigits, int maxDigits, strbuffer_t *buffer)
+{
+    // Optimization for 1, 2 and 4 digit numbers. This should
+    // cover most cases of formatting date/time related items.
+    // Note: This optimization code assumes that maxDigits is
+    // either 2 or Integer.MAX_VALUE (maxIntCount in format()).
+
+    // try
+    {
+        char zeroDigit = 0;
+        if (zeroDigit == 0)
+        {
+            // zeroDigit = ((DecimalFormat)numberFormat).getDecimalFormatSymbols().getZeroDigit();
+            zeroDigit = '0';
+        }
+        if (value >= 0)
+        {
+            if (value < 100 && minDigits >= 1 && minDigits <= 2)
+            {
+                if (value < 10)
+                {
+                    if (minDigits == 2)
+                    {
+                        add_strchar(buffer, zeroDigit);
+                    }
+                    add_strchar(buffer, (char)(zeroDigit + value));
+                }
+                else
+                {
+                    add_strchar(buffer, (char)(zeroDigit + value / 10));
+                    add_strchar(buffer, (char)(zeroDigit + value % 10));
+                }
+                return;
+            }
+            else if (value >= 1000 && value < 10000)
+            {
+                if (minDigits == 4)
+                {
+                    add_strchar(buffer, (char)(zeroDigit + value / 1000));
+                    value %= 1000;
+                    add_strchar(buffer, (char)(zeroDigit + value / 100));
+                    value %= 100;
+                    add_strchar(buffer, (char)(zeroDigit + value / 10));
+                    add_strchar(buffer, (char)(zeroDigit + value % 10));
+                    return;
+                }
+                if (minDigits == 2 && maxDigits == 2)
+                {
+                    zeroPaddingNumber(value % 100, 2, 2, buffer);
+                    return;
+                }
+            }
+        }
+    }
+    // catch (Exception e)
+    // {
+    // }
+
+    // numberFormat.setMinimumIntegerDigits(minDigits);
+    // numberFormat.setMaximumIntegerDigits(maxDigits);
+    // numberFormat.format((long)value, buffer, DontCareFieldPosition.INSTANCE);
+    add_integer(buffer, value, minDigits);
+}
+
+static locale_entry_t *locale_names_registry = NULL;
+static locale_snapshot_t *locale_snapshots = NULL;
+static pthread_mutex_t locale_names_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local const locale_names_t *last_locale_names = NULL;
+
+void set_name(name_t *name, const char *format, struct tm *info, locale_t loc)
+{
+    // strftime yields zero, that is an empty name, if the name doesn't fit.
+    name->length = (unsigned char)strftime_l(name->text, NAME_LENGTH, format, info, loc);
+}
+
+locale_names_t *load_locale_names(const char *locale)
+{
+    // The names are rendered once per locale with the C library, in a
+    // locale object of their own: the locale of the process is never changed.
+    if (strlen(locale) >= LOCALE_ID_LENGTH)
+    {
+        return NULL;
+    }
+
+    locale_t loc = newlocale(LC_TIME_MASK, locale, (locale_t)0);
+    if (loc == (locale_t)0)
+    {
+        return NULL;
+    }
+
+    locale_names_t *names = (locale_names_t *)calloc(1, sizeof(locale_names_t));
+    if (names != NULL)
+    {
+        struct tm info;
+        memset(&info, 0, sizeof(struct tm));
+        info.tm_year = 100;
+        info.tm_mday = 1;
+
+        for (int i = JANUARY; i <= DECEMBER; i++)
+        {
+            info.tm_mon = i;
+            set_name(names->months + i, "%B", &info, loc);
+            set_name(names->short_months + i, "%b", &info, loc);
+        }
+
+        for (int i = 0; i < 7; i++)
+        {
+            info.tm_wday = i;
+            set_name(names->weekdays + i, "%A", &info, loc);
+            set_name(names->short_weekdays + i, "%a", &info, loc);
+        }
+
+        for (int i = AM; i <= PM; i++)
+        {
+            info.tm_hour = i * 12;
+            set_name(names->ampm + i, "%p", &info, loc);
+        }
+
+        // The C library has no names for the Gregorian eras, these are the
+        // DateFormatSymbols ones of the root locale.
+        names->eras[0] = (name_t){2, "BC"};
+        names->eras[1] = (name_t){2, "AD"};
+
+        strcpy(names->locale, locale);
+    }
+
+    freelocale(loc);
+
+    return names;
+}
+
+int register_locale_names(const locale_names_t *names)
+{
+    // Called with locale_names_mutex held; later registrations take precedence.
+    locale_entry_t *entry = (locale_entry_t *)malloc(sizeof(locale_entry_t));
+    if (entry == NULL)
+    {
+        return 1;
+    }
+
+    entry->names = names;
+    entry->next = locale_names_registry;
+    locale_names_registry = entry;
+    return 0;
+}
+
+const locale_names_t *locale_names(const char *locale)
+{
+    const locale_names_t *names = last_locale_names;
+
+    if (names != NULL && strcmp(names->locale, locale) == 0)
+    {
+        return names;
+    }
+
+    pthread_mutex_lock(&locale_names_mutex);
+
+    names = NULL;
+    for (locale_entry_t *each = locale_names_registry; each != NULL; each = each->next)
+    {
+        if (strcmp(each->names->locale, locale) == 0)
+        {
+            names = each->names;
+            break;
+        }
+    }
+
+    if (names == NULL)
+    {
+        locale_names_t *loaded = load_locale_names(locale);
+        if (loaded != NULL && register_locale_names(loaded))
+        {
+            free(loaded);
+            loaded = NULL;
+        }
+        names = loaded;
+    }
+
+    pthread_mutex_unlock(&locale_names_mutex);
+
+    if (names != NULL)
+    {
+        last_locale_names = names;
+    }
+
+    return names;
+}
+
+int dtf_locales_dump(const char *path, const char **locales, int n, char *output)
+{
+    // The snapshot is a header followed by the locale_names_t records as
+    // they are in memory, so that a mapping of the file is used in place.
+    locale_snapshot_header_t header;
+    memset(&header, 0, sizeof(locale_snapshot_header_t));
+    memcpy(header.magic, LOCALE_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = LOCALE_SNAPSHOT_VERSION;
+    header.record_size = sizeof(locale_names_t);
+    header.count = n;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to open \"%s\" for writing.", path);
+        return 1;
+    }
+
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1;
+
+    for (int i = 0; i < n && !failed; i++)
+    {
+        const locale_names_t *names = locale_names(locales[i]);
+        if (names == NULL)
+        {
+            snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to set the \"%s\" locale.", locales[i]);
+            fclose(file);
+            remove(path);
+            return 1;
+        }
+        failed = fwrite(names, sizeof(locale_names_t), 1, file) != 1;
+    }
+
+    if (fclose(file) != 0 || failed)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to write \"%s\".", path);
+        remove(path);
+        return 1;
+    }
+
+    return 0;
+}
+
+void *map_snapshot(int fd, size_t size)
+{
+#ifdef _WIN32
+    char *base = (char *)malloc(size);
+    size_t done = 0;
+
+    while (base != NULL && done < size)
+    {
+        int r = read(fd, base + done, (unsigned)(size - done));
+        if (r <= 0)
+        {
+            free(base);
+            return NULL;
+        }
+        done += (size_t)r;
+    }
+    return base;
+#else
+    // Shared and read-only: forked workers keep using the same pages.
+    void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    return base == MAP_FAILED ? NULL : base;
+#endif
+}
+
+void unmap_snapshot(void *base, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    free(base);
+#else
+    munmap(base, size);
+#endif
+}
+
+int dtf_locales_load(const char *path, char *output)
+{
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to open \"%s\".", path);
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(locale_snapshot_header_t))
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "\"%s\" isn't a locale snapshot.", path);
+        close(fd);
+        return 1;
+    }
+
+    void *base = map_snapshot(fd, (size_t)st.st_size);
+    close(fd);
+
+    if (base == NULL)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to map \"%s\".", path);
+        return 1;
+    }
+
+    const locale_snapshot_header_t *header = (const locale_snapshot_header_t *)base;
+
+    if (memcmp(header->magic, LOCALE_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != LOCALE_SNAPSHOT_VERSION || header->record_size != sizeof(locale_names_t) ||
+        sizeof(locale_snapshot_header_t) + (size_t)header->count * sizeof(locale_names_t) > (size_t)st.st_size)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "\"%s\" isn't a locale snapshot of version %d.", path, LOCALE_SNAPSHOT_VERSION);
+        unmap_snapshot(base, (size_t)st.st_size);
+        return 1;
+    }
+
+    const locale_names_t *records = (const locale_names_t *)(header + 1);
+    locale_snapshot_t *snapshot = (locale_snapshot_t *)malloc(sizeof(locale_snapshot_t));
+    int failed = snapshot == NULL;
+
+    pthread_mutex_lock(&locale_names_mutex);
+    for (uint32_t i = 0; i < header->count && !failed; i++)
+    {
+        if (memchr(records[i].locale, '\0', LOCALE_ID_LENGTH) == NULL)
+        {
+            continue; // a malformed record can't be looked up, skip it.
+        }
+        failed = register_locale_names(records + i);
+    }
+
+    if (!failed)
+    {
+        snapshot->base = base;
+        snapshot->size = st.st_size;
+        snapshot->next = locale_snapshots;
+        locale_snapshots = snapshot;
+    }
+    pthread_mutex_unlock(&locale_names_mutex);
+
+    if (failed)
+    {
+        // Registered records stay mapped, the mapping is just not prewarmed.
+        free(snapshot);
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to register the locales of \"%s\".", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+void dtf_locales_prewarm(void)
+{
+#ifdef _WIN32
+    // Snapshots are read into memory, there is nothing to fault in.
+#else
+    long page = sysconf(_SC_PAGESIZE);
+    volatile char sink = 0;
+
+    pthread_mutex_lock(&locale_names_mutex);
+    for (locale_snapshot_t *each = locale_snapshots; each != NULL; each = each->next)
+    {
+        madvise(each->base, each->size, MADV_WILLNEED);
+        for (size_t k = 0; k < each->size; k += page)
+        {
+            sink += ((const char *)each->base)[k];
+        }
+    }
+    pthread_mutex_unlock(&locale_names_mutex);
+    (void)sink;
+#endif
+}
+
+int longest_name(const name_t *names, int n)
+{
+    int longest = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (names[i].length > longest)
+        {
+            longest = names[i].length;
+        }
+    }
+    return longest;
+}
+
+int dtf_compile_fixed(const char *pattern, const char *locale, buffer_t **compiledCodeRef, char *error)
+{
+    // Every field takes its widest form: numbers are padded with zeros to
+    // the digits of their largest value, years to four, "yy" too since it
+    // prints years below 1000 in full, and names, zone names and ISO
+    // offsets are followed by a TAG_PAD to a constant width. Records are
+    // of one width for the years 1 to 9999 only.
+    const locale_names_t *names = locale_names(locale);
+
+    if (names == NULL)
+    {
+        snprintf(error, ERROR_BUFFER_LENGTH, "Impossible to set the \"%s\" locale.", locale);
+        return 1;
+    }
+
+    buffer_t *compiledCode;
+
+    if (compile_pattern(pattern, &compiledCode, error))
+    {
+        return 1;
+    }
+
+    buffer_t *fixed = new_buffer(compiledCode->length * 2);
+    dtf_status_t status;
+    int failed = 0;
+
+    for (int i = 0; i < compiledCode->length && !failed;)
+    {
+        int tag, count, width = -1;
+        int j = next_tag(compiledCode, i, &tag, &count);
+
+        switch (tag)
+        {
+        case TAG_QUOTE_CHARS:
+            j += QUOTE_CELLS(count);
+            // fall through
+        case TAG_QUOTE_ASCII_CHAR:
+            for (int k = i; k < j; k++)
+            {
+                add_char(fixed, compiledCode->buffer[k]);
+            }
+            i = j;
+            continue;
+
+        case PATTERN_ERA:
+            width = longest_name(names->eras, 2);
+            break;
+
+        case PATTERN_MONTH:
+        case PATTERN_MONTH_STANDALONE:
+            if (count >= 4)
+                width = longest_name(names->months, 12);
+            else if (count == 3)
+                width = longest_name(names->short_months, 12);
+            else
+                count = 2;
+            break;
+
+        case PATTERN_DAY_OF_WEEK:
+            width = count >= 4 ? longest_name(names->weekdays, 7) : longest_name(names->short_weekdays, 7);
+            break;
+
+        case PATTERN_AM_PM:
+            width = longest_name(names->ampm, 2);
+            break;
+
+        case PATTERN_ZONE_NAME:
+            width = FIXED_ZONE_NAME_WIDTH;
+            break;
+
+        case PATTERN_ISO_ZONE:
+            width = count == 1 ? 3 : count == 2 ? 5 : 6; // "Z" is padded.
+            break;
+
+        case PATTERN_ZONE_VALUE:
+            break;
+
+        case PATTERN_YEAR:
+        case PATTERN_WEEK_YEAR:
+            if (count < 4)
+                count = 4;
+            break;
+
+        default:
+            if (count < PATTERN_MAX_DIGITS[tag])
+                count = PATTERN_MAX_DIGITS[tag];
+            break;
+        }
+
+        failed = encode(tag, count, fixed, &status);
+        if (!failed && width >= 0)
+        {
+            failed = encode(TAG_PAD, width, fixed, &status);
+        }
+        i = j;
+    }
+
+    free_buffer(compiledCode);
+
+    if (failed)
+    {
+        dtf_status_message(&status, error, ERROR_BUFFER_LENGTH);
+        free_buffer(fixed);
+        return 1;
+    }
+
+    *compiledCodeRef = mark_day_segments(fixed);
+
+    free_buffer(fixed);
+
+    return 0;
+}
+
+int subFormat(tm_t *tm, int patternCharIndex, int count, strbuffer_t *buffer, char *output)
+{
+    // int lua_type;
+    const locale_names_t *names = tm->names;
+    static const name_t empty = {0, ""};
+
+    int maxIntCount = INT_MAX;
+    const name_t *current = NULL;
+    // int beginOffset = luaL_bufflen(buffer);
+
+    int field = PATTERN_INDEX_TO_CALENDAR_FIELD[patternCharIndex];
+    int value;
+    int failed = 0;
+
+    const zone_strings_t *zone;
+    zone_strings_t scratch;
+
+    if (field == WEEK_YEAR)
+    {
+        // if (calendar.isWeekDateSupported())
+        // lua_type = lua_getfield(L, date_table_index, "isWeekDateSupported");
+        // if (lua_type == LUA_TBOOLEAN && lua_toboolean(L, -1))
+        // {
+        //     // value = calendar.getWeekYear();
+        //     lua_type = lua_getfield(L, date_table_index, "getWeekYear");
+        //     assert(lua_type == LUA_TNUMBER);
+        //     value = lua_tointeger(L, -1);
+        //     lua_pop(L, 1);
+        // }
+        // else
+        {
+            // use calendar year 'y' instead
+            patternCharIndex = PATTERN_YEAR;
+            field = PATTERN_INDEX_TO_CALENDAR_FIELD[patternCharIndex];
+            failed = calendar_get(tm, field, &value, output);
+            if (failed)
+                return failed;
+        }
+        // lua_pop(L, 1);
+    }
+    else
+    {
+        failed = calendar_get(tm, field, &value, output);
+        if (failed)
+            return failed;
+    }
+
+    // int style = (count >= 4) ? LONG_C : SHORT_C;
+    // if (!useDateFormatSymbols && field < ZONE_OFFSET && patternCharIndex != PATTERN_MONTH_STANDALONE)
+    // {
+    //     current = calendar.getDisplayName(field, style, locale);
+    // }
+
+    // Note: zeroPaddingNumber() assumes that maxDigits is either
+    // 2 or maxIntCount. If we make any changes to this,
+    // zeroPaddingNumber() must be fixed.
+
+    switch (patternCharIndex)
+    {
+    case PATTERN_ERA: // 'G'
+        // if (useDateFormatSymbols)
+        {
+            // const char **eras = formatData.getEras();
+            // calendar_getfield_at(L, date_table_index, "getEras", value, &current);
+            // current = eras[value];
+            current = names->eras + value;
+        }
+        if (current == NULL)
+        {
+            current = &empty;
+        }
+        break;
+
+    case PATTERN_WEEK_YEAR: // 'Y'
+    case PATTERN_YEAR:      // 'y'
+        // lua_type = lua_getfield(L, date_table_index, "isGregorianCalendar");
+        // if (lua_type == LUA_TBOOLEAN && lua_toboolean(L, -1))
+        {
+            if (count != 2)
+            {
+                zeroPaddingNumber(value, count, maxIntCount, buffer);
+            }
+            else
+            {
+                zeroPaddingNumber(value, 2, 2, buffer);
+            } // clip 1996 to 96
+        }
+        // else
+        // {
+        //     if (current == NULL)
+        //     {
+        //         zeroPaddingNumber(value, style == LONG_C ? 1 : count, maxIntCount, buffer);
+        //     }
+        // }
+        // lua_pop(L, 1);
+        break;
+
+    case PATTERN_MONTH_STANDALONE: // 'L'
+    case PATTERN_MONTH:            // 'M' (context sensitive)
+        // if (useDateFormatSymbols)
+        {
+            if (count >= 4)
+            {
+                // months = formatData.getMonths();
+                // current = months[value];
+                // calendar_getfield_at(L, date_table_index, "getMonths", value, &current);
+
+                current = names->months + value;
+            }
+            else if (count == 3)
+            {
+                // months = formatData.getShortMonths();
+                // current = months[value];
+                // calendar_getfield_at(L, date_table_index, "getShortMonths", value, &current);
+                current = names->short_months + value;
+            }
+        }
+        // else
+        // {
+        //     if (count < 3)
+        //     {
+        //         current = NULL;
+        //     }
+        //     else if (forceStandaloneForm)
+        //     {
+        //         current = calendar.getDisplayName(field, style | 0x8000, locale);
+        //         if (current == NULL)
+        //         {
+        //             current = calendar.getDisplayName(field, style, locale);
+        //         }
+        //     }
+        // }
+        if (current == NULL)
+        {
+            zeroPaddingNumber(value + 1, count, maxIntCount, buffer);
+        }
+        break;
+
+        // case PATTERN_MONTH_STANDALONE: // 'L'
+        //     assert(current == NULL);
+        //     // if (locale == NULL)
+        //     {
+        //         const char **months;
+        //         if (count >= 4)
+        //         {
+        //             months = formatData.getMonths();
+        //             current = months[value];
+        //         }
+        //         else if (count == 3)
+        //         {
+        //             months = formatData.getShortMonths();
+        //             current = months[value];
+        //         }
+        //     }
+        //     // else
+        //     // {
+        //     //     if (count >= 3)
+        //     //     {
+        //     //         current = calendar.getDisplayName(field, style | 0x8000, locale);
+        //     //     }
+        //     // }
+        //     if (current == NULL)
+        //     {
+        //         zeroPaddingNumber(value + 1, count, maxIntCount, buffer);
+        //     }
+        //     break;
+
+    case PATTERN_HOUR_OF_DAY1: // 'k' 1-based.  eg, 23:59 + 1 hour =>> 24:59
+        if (current == NULL)
+        {
+            if (value == 0)
+            {
+                zeroPaddingNumber(calendar_getMaximum(HOUR_OF_DAY) + 1, count, maxIntCount, buffer);
+            }
+            else
+            {
+                zeroPaddingNumber(value, count, maxIntCount, buffer);
+            }
+        }
+        break;
+
+    case PATTERN_DAY_OF_WEEK: // 'E'
+        // if (useDateFormatSymbols)
+        {
+            if (count >= 4)
+            {
+                // weekdays = formatData.getWeekdays();
+                // current = weekdays[value];
+                // calendar_getfield_at(L, date_table_index, "getWeekdays", value, &current);
+                current = names->weekdays + value;
+            }
+            else
+            { // count < 4, use abbreviated form if exists
+                // weekdays = formatData.getShortWeekdays();
+                // current = weekdays[value];
+                // calendar_getfield_at(L, date_table_index, "getShortWeekdays", value, &current);
+                current = names->short_weekdays + value;
+            }
+        }
+        break;
+
+    case PATTERN_AM_PM: // 'a'
+        // if (useDateFormatSymbols)
+        {
+            // const char **ampm = formatData.getAmPmStrings();
+            // current = ampm[value];
+            // calendar_getfield_at(L, date_table_index, "getAmPmStrings", value, &current);
+            current = names->ampm + value;
+        }
+        break;
+
+    case PATTERN_HOUR1: // 'h' 1-based.  eg, 11PM + 1 hour =>> 12 AM
+        if (current == NULL)
+        {
+            if (value == 0)
+            {
+                zeroPaddingNumber(calendar_getLeastMaximum(HOUR) + 1, count, maxIntCount, buffer);
+            }
+            else
+            {
+                zeroPaddingNumber(value, count, maxIntCount, buffer);
+            }
+        }
+        break;
+
+    case PATTERN_ZONE_NAME: // 'z'
+        if (current == NULL)
+        {
+            // if (formatData.locale == NULL || formatData.isZoneStringsSet)
+            // {
+            //     int zoneIndex =
+            //         formatData.getZoneIndex(calendar.getTimeZone().getID());
+            //     if (zoneIndex == -1)
+            //     {
+            //         value = calendar_get(date_table_index, ZONE_OFFSET) +
+            //                 calendar_get(date_table_index, DST_OFFSET);
+            //         buffer.append(ZoneInfoFile.toCustomID(value));
+            //     }
+            //     else
+            //     {
+            //         int index = (calendar_get(date_table_index, DST_OFFSET) == 0) ? 1 : 3;
+            //         if (count < 4)
+            //         {
+            //             // Use the short name
+            //             index++;
+            //         }
+            //         String[][] zoneStrings = formatData.getZoneStringsWrapper();
+            //         buffer.append(zoneStrings[zoneIndex][index]);
+            //     }
+            // }
+            // else
+            {
+                // TimeZone tz = calendar.getTimeZone();
+                // int tzstyle = (count < 4 ? TimeZone.SHORT_C : TimeZone.LONG_C);
+                // buffer.append(tz.getDisplayName(daylight, tzstyle, formatData.locale));
+                // bool daylight = (calendar_get(date_table_index, DST_OFFSET) != 0);
+
+                // char *s;
+                // if (count >= 4)
+                // {
+                //     calendar_getfield_at(L, date_table_index, "getTimeZone", 1, &s);
+                // }
+                // else
+                // {
+                //     calendar_getfield_at(L, date_table_index, "getShortTimeZone", 1, &s);
+                // }
+
+                zone = zone_strings(tm, &scratch);
+                add_lstring(buffer, zone->name, zone->name_length);
+            }
+        }
+        break;
+
+    case PATTERN_ZONE_VALUE: // 'Z' ("-/+hhmm" form)
+        zone = zone_strings(tm, &scratch);
+        add_lstring(buffer, zone->rfc822, 5);
+        break;
+
+    case PATTERN_ISO_ZONE: // 'X'
+        zone = zone_strings(tm, &scratch);
+        add_lstring(buffer, zone->iso8601[count - 1], zone->iso8601_length[count - 1]);
+        break;
+
+    default:
+        // case PATTERN_DAY_OF_MONTH:         // 'd'
+        // case PATTERN_HOUR_OF_DAY0:         // 'H' 0-based.  eg, 23:59 + 1 hour =>> 00:59
+        // case PATTERN_MINUTE:               // 'm'
+        // case PATTERN_SECOND:               // 's'
+        // case PATTERN_MILLISECOND:          // 'S'
+        // case PATTERN_DAY_OF_YEAR:          // 'D'
+        // case PATTERN_DAY_OF_WEEK_IN_MONTH: // 'F'
+        // case PATTERN_WEEK_OF_YEAR:         // 'w'
+        // case PATTERN_WEEK_OF_MONTH:        // 'W'
+        // case PATTERN_HOUR0:                // 'K' eg, 11PM + 1 hour =>> 0 AM
+        // case PATTERN_ISO_DAY_OF_WEEK:      // 'u' pseudo field, Monday = 1, ..., Sunday = 7
+        if (current == NULL)
+        {
+            zeroPaddingNumber(value, count, maxIntCount, buffer);
+        }
+        break;
+    } // switch (patternCharIndex)
+
+    if (current != NULL)
+    {
+        add_lstring(buffer, current->text, current->length);
+    }
+
+    // int fieldID = PATTERN_INDEX_TO_DATE_FORMAT_FIELD[patternCharIndex];
+    // field_t f = PATTERN_INDEX_TO_DATE_FORMAT_FIELD_ID[patternCharIndex];
+
+    // formatted(fieldID, f, f, beginOffset, luaL_bufflen(buffer), buffer);
+    return failed;
+}
+
+static _Thread_local day_segment_t day_segments_cache[DAY_SEGMENTS_CACHE_SIZE];
+
+static inline char *put2(char *p, int v)
+{
+    p[0] = (char)('0' + v / 10);
+    p[1] = (char)('0' + v % 10);
+    return p + 2;
+}
+
+static inline char *put_name(char *p, const name_t *name)
+{
+    memcpy(p, name->text, name->length);
+    return p + name->length;
+}
+
+int format_kernel(int kernel, tm_t *tm, strbuffer_t *toAppendTo)
+{
+    // Straight-line rendering of a KERNEL_* pattern; -1 leaves it to the
+    // generic code, for years out of [0, 9999].
+    calendar_resolve(tm);
+
+    long year = tm->year;
+    int month = tm->month, day = tm->mday;
+
+    if (year < 0 || year > 9999)
+    {
+        return -1;
+    }
+
+    char *p = reserve_strbuffer(toAppendTo, 4 * NAME_LENGTH + 32);
+    if (p == NULL)
+    {
+        return -1;
+    }
+
+    char *start = p;
+    const locale_names_t *names = tm->names;
+    int hour = tm->seconds / 3600, minute = tm->seconds / 60 % 60, second = tm->seconds % 60;
+    int offset = tm->zone_offset / 60, sign = offset < 0 ? '-' : '+';
+    if (offset < 0)
+    {
+        offset = -offset;
+    }
+
+    switch (kernel)
+    {
+    case KERNEL_ISO_SECONDS:
+    case KERNEL_ISO_MILLIS:
+    case KERNEL_ISO_SECONDS_ZONE:
+    case KERNEL_ISO_MILLIS_ZONE:
+        p = put2(put2(p, (int)(year / 100)), (int)(year % 100));
+        *p++ = '-';
+        p = put2(p, month);
+        *p++ = '-';
+        p = put2(p, day);
+        *p++ = 'T';
+        p = put2(p, hour);
+        *p++ = ':';
+        p = put2(p, minute);
+        *p++ = ':';
+        p = put2(p, second);
+        if (kernel == KERNEL_ISO_MILLIS || kernel == KERNEL_ISO_MILLIS_ZONE)
+        {
+            int millis = tm->nanos / 1000000;
+            *p++ = '.';
+            *p++ = (char)('0' + millis / 100);
+            p = put2(p, millis % 100);
+        }
+        if (kernel == KERNEL_ISO_SECONDS_ZONE || kernel == KERNEL_ISO_MILLIS_ZONE)
+        {
+            if (offset == 0)
+            {
+                *p++ = 'Z';
+            }
+            else
+            {
+                *p++ = (char)sign;
+                p = put2(p, offset / 60);
+                *p++ = ':';
+                p = put2(p, offset % 60);
+            }
+        }
+        break;
+
+    case KERNEL_RFC1123:
+        p = put_name(p, names->short_weekdays + floorMod(tm->day + 4, 7)); // 1970-01-01 is a Thursday.
+        *p++ = ',';
+        *p++ = ' ';
+        p = put2(p, day);
+        *p++ = ' ';
+        p = put_name(p, names->short_months + month - 1);
+        *p++ = ' ';
+        p = put2(put2(p, (int)(year / 100)), (int)(year % 100));
+        *p++ = ' ';
+        p = put2(p, hour);
+        *p++ = ':';
+        p = put2(p, minute);
+        *p++ = ':';
+        p = put2(p, second);
+        memcpy(p, " GMT", 4);
+        p += 4;
+        break;
+
+    case KERNEL_COMMON_LOG:
+        p = put2(p, day);
+        *p++ = '/';
+        p = put_name(p, names->short_months + month - 1);
+        *p++ = '/';
+        p = put2(put2(p, (int)(year / 100)), (int)(year % 100));
+        *p++ = ':';
+        p = put2(p, hour);
+        *p++ = ':';
+        p = put2(p, minute);
+        *p++ = ':';
+        p = put2(p, second);
+        *p++ = ' ';
+        *p++ = (char)sign;
+        p = put2(p, offset / 60);
+        p = put2(p, offset % 60);
+        break;
+
+    case KERNEL_SYSLOG:
+        p = put_name(p, names->short_months + month - 1);
+        *p++ = ' ';
+        if (day >= 10)
+        {
+            *p++ = (char)('0' + day / 10);
+        }
+        *p++ = (char)('0' + day % 10);
+        *p++ = ' ';
+        p = put2(p, hour);
+        *p++ = ':';
+        p = put2(p, minute);
+        *p++ = ':';
+        p = put2(p, second);
+        break;
+
+    default:
+        return -1;
+    }
+
+    toAppendTo->length += p - start;
+    return 0;
+}
+
+int format_range(buffer_t *compiledPattern, int from, int to, tm_t *tm, strbuffer_t *toAppendTo, char *output);
+
+int format_day_segment(buffer_t *compiledPattern, int from, int to, tm_t *tm, strbuffer_t *toAppendTo, char *output)
+{
+    const char_t *cells = compiledPattern->buffer + from;
+    int ncells = to - from;
+
+    size_t h = ((size_t)cells >> 4) ^ ((size_t)tm->day * 2654435761u);
+    day_segment_t *e = day_segments_cache + (h & (DAY_SEGMENTS_CACHE_SIZE - 1));
+
+    if (e->cells == cells && e->day == tm->day && e->names == tm->names && e->ncells == ncells &&
+        memcmp(e->code, cells, ncells * sizeof(char_t)) == 0)
+    {
+        add_lstring(toAppendTo, e->rendered, e->length);
+        return 0;
+    }
+
+    size_t start = toAppendTo->length;
+
+    int failed = format_range(compiledPattern, from, to, tm, toAppendTo, output);
+
+    size_t length = toAppendTo->length - start;
+
+    if (!failed && ncells <= DAY_SEGMENT_CELLS && length <= DAY_SEGMENT_LENGTH)
+    {
+        e->cells = cells;
+        e->ncells = ncells;
+        memcpy(e->code, cells, ncells * sizeof(char_t));
+        e->day = tm->day;
+        e->names = tm->names;
+        memcpy(e->rendered, toAppendTo->buffer + start, length);
+        e->length = length;
+    }
+
+    return failed;
+}
+
+int format_range(buffer_t *compiledPattern, int from, int to, tm_t *tm, strbuffer_t *toAppendTo, char *output)
+{
+    int failed = 0;
+    int tag, count;
+    size_t field_start = toAppendTo->length;
+
+    for (int i = from; i < to;)
+    {
+        i = next_tag(compiledPattern, i, &tag, &count);
+
+        switch (tag)
+        {
+        case TAG_QUOTE_ASCII_CHAR:
+            add_strchar(toAppendTo, (char)count);
+            break;
+
+        case TAG_QUOTE_CHARS:
+            add_lstring(toAppendTo, (const char *)(compiledPattern->buffer + i), count);
+            i += QUOTE_CELLS(count);
+            break;
+
+        case TAG_DAY_SEGMENT:
+            failed = format_day_segment(compiledPattern, i, i + count, tm, toAppendTo, output);
+            if (failed)
+                return failed;
+            i += count;
+            break;
+
+        case TAG_KERNEL:
+            // Always first, so the range is the whole pattern.
+            if (format_kernel(count, tm, toAppendTo) == 0)
+            {
+                return 0;
+            }
+            break;
+
+        case TAG_PAD:
+            // Spaces up to count bytes from the start of the field before, or cut it there.
+            if (toAppendTo->length - field_start < (size_t)count)
+            {
+                size_t n = count - (toAppendTo->length - field_start);
+                char *p = reserve_strbuffer(toAppendTo, n);
+                if (p != NULL)
+                {
+                    memset(p, ' ', n);
+                    toAppendTo->length += n;
+                }
+            }
+            else
+            {
+                toAppendTo->length = field_start + count;
+            }
+            break;
+
+        default:
+            field_start = toAppendTo->length;
+            failed = subFormat(tm, tag, count, toAppendTo, output);
+            if (failed)
+                return failed;
+            else
+                break;
+        }
+    }
+
+    return failed;
+}
+
+int init_tm_zone(tm_t *tm, time_t timer, const char *locale, int offset, const char *timezone, int local, char *output)
+{
+    const locale_names_t *names = locale_names(locale);
+
+    if (names == NULL)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to set the \"%s\" locale.", locale);
+        return 1;
+    }
+
+    tm->zone_name = timezone;
+    tm->zone_offset = offset;
+    tm->localtime = local;
+    tm->names = names;
+    tm->isdst = -1;
+    tm->civil = 0;
+
+    if (local)
+    {
+        const zone_period_t *period = local_zone_period(timer);
+        if (period == NULL)
+        {
+            snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to get the local time of %ld.", (long)timer);
+            return 1;
+        }
+
+        tm->zone_offset = period->offset;
+        tm->isdst = period->isdst;
+        tm->zone_name = period->name;
+    }
+
+    return 0;
+}
+
+int init_tm(tm_t *tm, time_t timer, long nanos, const char *locale, int offset, const char *timezone, int local, char *output)
+{
+    if (init_tm_zone(tm, timer, locale, offset, timezone, local, output))
+    {
+        return 1;
+    }
+
+    tm->timer = timer + tm->zone_offset;
+    tm->day = floorDiv(tm->timer, 86400);
+    tm->seconds = (int)(tm->timer - tm->day * 86400);
+    tm->nanos = (int)nanos;
+
+    return 0;
+}
+
+int dtf_formatbn(buffer_t *compiledPattern, time_t timer, long nanos, const char *locale, int offset, const char *timezone, int local, strbuffer_t *toAppendTo, char *output)
+{
+    tm_t tm; //  allocate the main structure to hold all the data.
+
+    if (init_tm(&tm, timer, nanos, locale, offset, timezone, local, output))
+    {
+        return 1;
+    }
+
+    return format_range(compiledPattern, 0, compiledPattern->length, &tm, toAppendTo, output);
+}
+
+void tm_from_utc(tm_t *tm, tm_t *utc, long nanos)
+{
+    // The local day is the UTC one, or the one next to it when the offset
+    // crosses midnight: its civil date is a step from the UTC one.
+    long seconds = utc->seconds + (long)tm->zone_offset;
+    long shift = floorDiv(seconds, 86400);
+
+    tm->timer = utc->timer + tm->zone_offset;
+    tm->day = utc->day + shift;
+    tm->seconds = (int)(seconds - shift * 86400);
+    tm->nanos = (int)nanos;
+    tm->civil = 0;
+
+    if (shift >= -1 && shift <= 1)
+    {
+        calendar_resolve(utc);
+        tm->year = utc->year;
+        tm->month = utc->month;
+        tm->mday = utc->mday;
+        civil_step(&tm->year, &tm->month, &tm->mday, (int)shift);
+        tm->civil = 1;
+    }
+}
+
+int dtf_formatb(buffer_t *compiledPattern, time_t timer, const char *locale, int offset, const char *timezone, int local, strbuffer_t *toAppendTo, char *output)
+{
+    return dtf_formatbn(compiledPattern, timer, 0, locale, offset, timezone, local, toAppendTo, output);
+}
+
+int dtf_format(buffer_t *compiledPattern, time_t timer, const char *locale, int offset, const char *timezone, int local, char *output)
+{
+    strbuffer_t toAppendTo;
+    init_strbuffer(&toAppendTo);
+
+    int failed = dtf_formatb(compiledPattern, timer, locale, offset, timezone, local, &toAppendTo, output);
+
+    if (!failed)
+    {
+        memcpy(output, toAppendTo.buffer, toAppendTo.length);
+        output[toAppendTo.length] = '\0';
+    }
+
+    free_strbuffer(&toAppendTo);
+
+    return failed;
+}
+
+int dtf_format_many(const dtf_formatter_t *targets, int n, time_t timer, long nanos, strbuffer_t *data, int64_t *offsets, char *output)
+{
+    // One calendar per distinct offset, shared by the targets with that
+    // offset, all made from the UTC day and its civil date, computed once.
+    tm_t calendars[FORMAT_MANY_CALENDARS];
+    tm_t utc;
+    int ncalendars = 0;
+    int local_offset_value = 0;
+    bool local_known = false;
+
+    utc.timer = timer;
+    utc.day = floorDiv(timer, 86400);
+    utc.seconds = (int)(timer - utc.day * 86400);
+    utc.civil = 0;
+
+    offsets[0] = data->length;
+
+    for (int i = 0; i < n; i++)
+    {
+        const dtf_formatter_t *f = targets + i;
+        int offset = f->offset;
+        tm_t *tm = NULL;
+        tm_t scratch;
+
+        if (f->local && local_known)
+        {
+            offset = local_offset_value;
+        }
+
+        for (int k = 0; k < ncalendars && (!f->local || local_known); k++)
+        {
+            if (calendars[k].zone_offset == offset && calendars[k].localtime == f->local)
+            {
+                tm = calendars + k;
+                break;
+            }
+        }
+
+        if (tm == NULL)
+        {
+            tm = ncalendars < FORMAT_MANY_CALENDARS ? calendars + ncalendars++ : &scratch;
+
+            if (init_tm_zone(tm, timer, f->locale, f->offset, f->timezone, f->local, output))
+            {
+                return 1;
+            }
+            tm_from_utc(tm, &utc, nanos);
+
+            if (f->local)
+            {
+                local_offset_value = tm->zone_offset;
+                local_known = true;
+            }
+        }
+        else
+        {
+            tm->names = locale_names(f->locale);
+            if (tm->names == NULL)
+            {
+                snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to set the \"%s\" locale.", f->locale);
+                return 1;
+            }
+            if (!f->local)
+            {
+                tm->zone_name = f->timezone; // the local one comes with its offset period.
+            }
+        }
+
+        if (format_range(f->compiled, 0, f->compiled->length, tm, data, output))
+        {
+            return 1;
+        }
+
+        offsets[i + 1] = data->length;
+    }
+
+    return 0;
+}
+
+bool is_numeric_field(int tag, int count)
+{
+    switch (tag)
+    {
+    case PATTERN_MONTH:
+    case PATTERN_MONTH_STANDALONE:
+        return count < 3;
+    case PATTERN_ERA:
+    case PATTERN_DAY_OF_WEEK:
+    case PATTERN_AM_PM:
+    case PATTERN_ZONE_NAME:
+    case PATTERN_ZONE_VALUE:
+    case PATTERN_ISO_ZONE:
+        return false;
+    default:
+        return tag >= 0 && tag < TAG_QUOTE_ASCII_CHAR;
+    }
+}
+
+int peek_tag(buffer_t *compiledPattern, int i, int *tag, int *count)
+{
+    // Day segments are transparent for the parser, so it looks through them.
+    while (i < compiledPattern->length)
+    {
+        int j = next_tag(compiledPattern, i, tag, count);
+        if (*tag != TAG_DAY_SEGMENT)
+        {
+            return 1;
+        }
+        i = j;
+    }
+    return 0;
+}
+
+int parse_digits(const char *text, size_t length, size_t *pos, int minDigits, int maxDigits, long *value)
+{
+    size_t p = *pos;
+    long v = 0;
+    int n = 0;
+
+    while (p < length && n < maxDigits && text[p] >= '0' && text[p] <= '9')
+    {
+        v = v * 10 + (text[p++] - '0');
+        n++;
+    }
+
+    if (n < minDigits)
+    {
+        return 0;
+    }
+
+    *pos = p;
+    *value = v;
+    return n;
+}
+
+int match_name(const char *text, size_t length, size_t *pos, const name_t *names, int n)
+{
+    // Longest case insensitive match among the given names, its index or -1.
+    int found = -1;
+    size_t best = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        size_t l = names[i].length;
+        if (l == 0 || l <= best || *pos + l > length)
+        {
+            continue;
+        }
+
+        size_t k;
+        for (k = 0; k < l; k++)
+        {
+            unsigned char a = text[*pos + k], b = names[i].text[k];
+            if (a != b && !(a < 128 && b < 128 && tolower(a) == tolower(b)))
+            {
+                break;
+            }
+        }
+
+        if (k == l)
+        {
+            found = i;
+            best = l;
+        }
+    }
+
+    if (found >= 0)
+    {
+        *pos += best;
+    }
+    return found;
+}
+
+int parse_offset(const char *text, size_t length, size_t *pos, bool colon, int *offset)
+{
+    // "+hh", "+hhmm" or "+hh:mm", the latter when colon is true.
+    size_t p = *pos;
+    long hh, mm = 0;
+
+    if (p >= length || (text[p] != '+' && text[p] != '-'))
+    {
+        return 0;
+    }
+
+    int sign = text[p++] == '-' ? -1 : 1;
+
+    if (!parse_digits(text, length, &p, 2, 2, &hh) || hh > 23)
+    {
+        return 0;
+    }
+
+    size_t q = p;
+    if (colon && q < length && text[q] == ':')
+    {
+        q++;
+    }
+
+    if ((!colon || q > p) && parse_digits(text, length, &q, 2, 2, &mm))
+    {
+        if (mm > 59)
+        {
+            return 0;
+        }
+        p = q;
+    }
+
+    *offset = sign * (int)(hh * 3600 + mm * 60);
+    *pos = p;
+    return 1;
+}
+
+bool is_abutting(buffer_t *compiledPattern, int i)
+{
+    // Whether a numeric field comes right after the field ending at i.
+    int next, next_count;
+    return peek_tag(compiledPattern, i, &next, &next_count) && is_numeric_field(next, next_count);
+}
+
+int parse_field(int tag, int count, bool abutting, const char *text, size_t length,
+                size_t *pos, fields_t *fields, const locale_names_t *names, const char *timezone, int offset, char *output)
+{
+    long value = 0;
+    int digits;
+    int minDigits = 1, maxDigits = 10;
+
+    // Abutting numeric fields, as in "yyyyMMdd", take exactly count digits.
+    if (abutting)
+    {
+        minDigits = maxDigits = count;
+    }
+
+    switch (tag)
+    {
+    case PATTERN_ERA:
+        return 1;
+
+    case PATTERN_YEAR:
+    case PATTERN_WEEK_YEAR:
+        digits = parse_digits(text, length, pos, minDigits, maxDigits, &value);
+        if (!digits)
+            return 0;
+        fields->year = value;
+        fields->ambiguous_year = count <= 2 && digits == 2;
+        return 1;
+
+    case PATTERN_MONTH:
+    case PATTERN_MONTH_STANDALONE:
+        if (count >= 3)
+        {
+            int m = match_name(text, length, pos, names->months, 12);
+            if (m < 0)
+                m = match_name(text, length, pos, names->short_months, 12);
+            if (m < 0)
+                return 0;
+            fields->month = m + 1;
+            return 1;
+        }
+        if (!parse_digits(text, length, pos, minDigits, maxDigits, &value) || value < 1 || value > 12)
+            return 0;
+        fields->month = (int)value;
+        return 1;
+
+    case PATTERN_DAY_OF_MONTH:
+        if (!parse_digits(text, length, pos, minDigits, maxDigits, &value) || value < 1 || value > 31)
+            return 0;
+        fields->day = (int)value;
+        return 1;
+
+    case PATTERN_DAY_OF_YEAR:
+        if (!parse_digits(text, length, pos, minDigits, maxDigits, &value) || value < 1 || value > 366)
+            return 0;
+        fields->day_of_year = (int)value;
+        return 1;
+
+    case PATTERN_HOUR_OF_DAY0: // 'H'
+    case PATTERN_HOUR_OF_DAY1: // 'k'
+        if (!parse_digits(text, length, pos, minDigits, maxDigits, &value) || value > 24)
+            return 0;
+        fields->hour = (int)(value % 24);
+        return 1;
+
+    case PATTERN_HOUR0: // 'K'
+    case PATTERN_HOUR1: // 'h'
+        if (!parse_digits(text, length, pos, minDigits, maxDigits, &value) || value > 12)
+            return 0;
+        fields->hour = (int)(value % 12);
+        fields->hour12 = true;
+        return 1;
+
+    case PATTERN_MINUTE:
+        if (!parse_digits(text, length, pos, minDigits, maxDigits, &value) || value > 59)
+            return 0;
+        fields->minute = (int)value;
+        return 1;
+
+    case PATTERN_SECOND:
+        if (!parse_digits(text, length, pos, minDigits, maxDigits, &value) || value > 60)
+            return 0;
+        fields->second = (int)value;
+        return 1;
+
+    case PATTERN_MILLISECOND:
+        if (!parse_digits(text, length, pos, minDigits, maxDigits, &value) || value > 999)
+            return 0;
+        fields->nanos = value * 1000000;
+        return 1;
+
+    case PATTERN_DAY_OF_WEEK:
+        if (match_name(text, length, pos, names->weekdays, 7) < 0 &&
+            match_name(text, length, pos, names->short_weekdays, 7) < 0)
+            return 0;
+        return 1; // the day of week is implied by the date.
+
+    case PATTERN_ISO_DAY_OF_WEEK:
+        return parse_digits(text, length, pos, 1, 1, &value) && value >= 1 && value <= 7;
+
+    case PATTERN_AM_PM:
+        fields->ampm = match_name(text, length, pos, names->ampm, 2);
+        return fields->ampm >= 0;
+
+    case PATTERN_ZONE_NAME:
+    {
+        size_t p = *pos, l = strlen(timezone);
+
+        if (l > 0 && p + l <= length && strncmp(text + p, timezone, l) == 0)
+        {
+            *pos = p + l;
+            fields->zone_offset = offset;
+            fields->has_zone = true;
+            return 1;
+        }
+
+        if (p + 3 <= length && (strncmp(text + p, "GMT", 3) == 0 || strncmp(text + p, "UTC", 3) == 0))
+        {
+            *pos = p + 3;
+            fields->zone_offset = 0;
+            fields->has_zone = true;
+            parse_offset(text, length, pos, true, &fields->zone_offset); // "GMT+01:00"
+            return 1;
+        }
+        return 0;
+    }
+
+    case PATTERN_ZONE_VALUE:
+        if (!parse_offset(text, length, pos, false, &fields->zone_offset))
+            return 0;
+        fields->has_zone = true;
+        return 1;
+
+    case PATTERN_ISO_ZONE:
+        if (*pos < length && text[*pos] == 'Z')
+        {
+            (*pos)++;
+            fields->zone_offset = 0;
+        }
+        else if (!parse_offset(text, length, pos, count == 3, &fields->zone_offset))
+        {
+            return 0;
+        }
+        fields->has_zone = true;
+        return 1;
+
+    default:
+        snprintf(output, ERROR_BUFFER_LENGTH, "Parsing of pattern letter '%c' isn't supported.", patternChars[tag]);
+        return -1;
+    }
+}
+
+void init_fields(fields_t *fields)
+{
+    memset(fields, 0, sizeof(fields_t));
+    fields->year = 1970;
+    fields->month = 1;
+    fields->day = 1;
+    fields->ampm = -1;
+}
+
+int fields_to_epoch(fields_t *fields, int offset, int local, parsed_t *parsed)
+{
+    long year = fields->year;
+
+    if (fields->ambiguous_year)
+    {
+        // As SimpleDateFormat does, the century puts the year within 80
+        // years before and 20 years after the current one.
+        long current;
+        int month, day;
+        civil_from_days(floorDiv(time(NULL), 86400), &current, &month, &day);
+
+        year += (current - 80) / 100 * 100;
+        if (year < current - 80)
+        {
+            year += 100;
+        }
+    }
+
+    long days = fields->day_of_year > 0 && fields->month == 1 && fields->day == 1
+                    ? days_from_civil(year, 1, 1) + fields->day_of_year - 1
+                    : days_from_civil(year, fields->month, fields->day);
+
+    int hour = fields->hour + (fields->hour12 && fields->ampm == PM ? 12 : 0);
+    long seconds = days * 86400L + hour * 3600L + fields->minute * 60L + fields->second;
+
+    if (fields->has_zone)
+    {
+        parsed->zone_offset = fields->zone_offset;
+    }
+    else if (local)
+    {
+        time_t timer = local_to_utc((time_t)seconds, -1, offset, &parsed->zone_offset);
+        seconds = timer + parsed->zone_offset;
+    }
+    else
+    {
+        parsed->zone_offset = offset;
+    }
+
+    parsed->timer = (time_t)(seconds - parsed->zone_offset);
+    parsed->nanos = fields->nanos;
+    return 1;
+}
+
+static inline int digits_at(const char *text, size_t length, size_t pos, int n)
+{
+    // The value of exactly n digits at pos, -1 if they aren't there.
+    int v = 0;
+
+    if (pos + n > length)
+    {
+        return -1;
+    }
+    for (int k = 0; k < n; k++)
+    {
+        unsigned char c = text[pos + k];
+        if (c < '0' || c > '9')
+        {
+            return -1;
+        }
+        v = v * 10 + (c - '0');
+    }
+    return v;
+}
+
+static inline bool char_at(const char *text, size_t length, size_t pos, char c)
+{
+    return pos < length && text[pos] == c;
+}
+
+static inline bool digit_at(const char *text, size_t length, size_t pos)
+{
+    return pos < length && text[pos] >= '0' && text[pos] <= '9';
+}
+
+int parse_time_of_day(const char *text, size_t length, size_t *pos, fields_t *fields)
+{
+    // "HH:mm:ss" at pos.
+    size_t p = *pos;
+    int hour = digits_at(text, length, p, 2), minute = digits_at(text, length, p + 3, 2), second = digits_at(text, length, p + 6, 2);
+
+    if (hour < 0 || hour > 24 || !char_at(text, length, p + 2, ':') || minute < 0 || minute > 59 ||
+        !char_at(text, length, p + 5, ':') || second < 0 || second > 60)
+    {
+        return 0;
+    }
+
+    fields->hour = hour % 24;
+    fields->minute = minute;
+    fields->second = second;
+    *pos = p + 8;
+    return 1;
+}
+
+int parse_kernel(int kernel, const char *text, size_t length, const locale_names_t *names, int offset, int local, parsed_t *parsed)
+{
+    // Straight-line parsing of a KERNEL_* pattern, for texts in its exact
+    // canonical shape; 0 leaves any other text to the generic parser, which
+    // gives the same result for the canonical ones.
+    fields_t fields;
+    init_fields(&fields);
+
+    size_t pos = 0;
+    int year, month, day, millis;
+
+    switch (kernel)
+    {
+    case KERNEL_ISO_SECONDS:
+    case KERNEL_ISO_MILLIS:
+    case KERNEL_ISO_SECONDS_ZONE:
+    case KERNEL_ISO_MILLIS_ZONE:
+        year = digits_at(text, length, 0, 4);
+        month = digits_at(text, length, 5, 2);
+        day = digits_at(text, length, 8, 2);
+        if (year < 0 || !char_at(text, length, 4, '-') || month < 1 || month > 12 || !char_at(text, length, 7, '-') ||
+            day < 1 || day > 31 || !char_at(text, length, 10, 'T'))
+            return 0;
+        pos = 11;
+        if (!parse_time_of_day(text, length, &pos, &fields) || digit_at(text, length, pos))
+            return 0;
+        if (kernel == KERNEL_ISO_MILLIS || kernel == KERNEL_ISO_MILLIS_ZONE)
+        {
+            millis = digits_at(text, length, pos + 1, 3);
+            if (!char_at(text, length, pos, '.') || millis < 0 || digit_at(text, length, pos + 4))
+                return 0;
+            fields.nanos = millis * 1000000L;
+            pos += 4;
+        }
+        if (kernel == KERNEL_ISO_SECONDS_ZONE || kernel == KERNEL_ISO_MILLIS_ZONE)
+        {
+            if (char_at(text, length, pos, 'Z'))
+            {
+                pos++;
+                fields.zone_offset = 0;
+            }
+            else if (!parse_offset(text, length, &pos, true, &fields.zone_offset))
+            {
+                return 0;
+            }
+            fields.has_zone = true;
+        }
+        break;
+
+    case KERNEL_RFC1123:
+        if (match_name(text, length, &pos, names->weekdays, 7) < 0 &&
+            match_name(text, length, &pos, names->short_weekdays, 7) < 0)
+            return 0;
+        day = digits_at(text, length, pos + 2, 2);
+        if (!char_at(text, length, pos, ',') || !char_at(text, length, pos + 1, ' ') || day < 1 || day > 31 ||
+            !char_at(text, length, pos + 4, ' '))
+            return 0;
+        pos += 5;
+        if ((month = match_name(text, length, &pos, names->months, 12)) < 0 &&
+            (month = match_name(text, length, &pos, names->short_months, 12)) < 0)
+            return 0;
+        month++;
+        year = digits_at(text, length, pos + 1, 4);
+        if (!char_at(text, length, pos, ' ') || year < 0 || !char_at(text, length, pos + 5, ' '))
+            return 0;
+        pos += 6;
+        if (!parse_time_of_day(text, length, &pos, &fields) || length - pos < 4 || memcmp(text + pos, " GMT", 4) != 0)
+            return 0;
+        pos += 4;
+        break;
+
+    case KERNEL_COMMON_LOG:
+        day = digits_at(text, length, 0, 2);
+        if (day < 1 || day > 31 || !char_at(text, length, 2, '/'))
+            return 0;
+        pos = 3;
+        if ((month = match_name(text, length, &pos, names->months, 12)) < 0 &&
+            (month = match_name(text, length, &pos, names->short_months, 12)) < 0)
+            return 0;
+        month++;
+        year = digits_at(text, length, pos + 1, 4);
+        if (!char_at(text, length, pos, '/') || year < 0 || !char_at(text, length, pos + 5, ':'))
+            return 0;
+        pos += 6;
+        if (!parse_time_of_day(text, length, &pos, &fields) || !char_at(text, length, pos, ' '))
+            return 0;
+        pos++;
+        if (!parse_offset(text, length, &pos, false, &fields.zone_offset))
+            return 0;
+        fields.has_zone = true;
+        break;
+
+    case KERNEL_SYSLOG:
+        if ((month = match_name(text, length, &pos, names->months, 12)) < 0 &&
+            (month = match_name(text, length, &pos, names->short_months, 12)) < 0)
+            return 0;
+        month++;
+        if (!char_at(text, length, pos, ' ') || !digit_at(text, length, pos + 1))
+            return 0;
+        pos++;
+        day = text[pos++] - '0';
+        if (digit_at(text, length, pos))
+            day = day * 10 + (text[pos++] - '0');
+        if (day < 1 || day > 31 || !char_at(text, length, pos, ' '))
+            return 0;
+        pos++;
+        year = 1970;
+        if (!parse_time_of_day(text, length, &pos, &fields) || digit_at(text, length, pos))
+            return 0;
+        break;
+
+    default:
+        return 0;
+    }
+
+    fields.year = year;
+    fields.month = month;
+    fields.day = day;
+
+    if (!fields_to_epoch(&fields, offset, local, parsed))
+    {
+        return 0;
+    }
+
+    parsed->length = pos;
+    return 1;
+}
+
+int parse_compiled(buffer_t *compiledPattern, const char *text, size_t length, const locale_names_t *names,
+                   int offset, const char *timezone, int local, parsed_t *parsed, char *output)
+{
+    if (compiledPattern->length > 0 && triple_shift(compiledPattern->buffer[0], 8) == TAG_KERNEL &&
+        parse_kernel(compiledPattern->buffer[0] & 0xff, text, length, names, offset, local, parsed))
+    {
+        return 1;
+    }
+
+    fields_t fields;
+    init_fields(&fields);
+
+    size_t pos = 0, field_start = 0;
+    int tag, count;
+
+    for (int i = 0; i < compiledPattern->length;)
+    {
+        i = next_tag(compiledPattern, i, &tag, &count);
+
+        switch (tag)
+        {
+        case TAG_QUOTE_ASCII_CHAR:
+            if (pos >= length || (unsigned char)text[pos] != count)
+                return 0;
+            pos++;
+            break;
+
+        case TAG_QUOTE_CHARS:
+            if (pos + count > length || memcmp(text + pos, compiledPattern->buffer + i, count) != 0)
+                return 0;
+            pos += count;
+            i += QUOTE_CELLS(count);
+            break;
+
+        case TAG_DAY_SEGMENT:
+        case TAG_KERNEL:
+            break;
+
+        case TAG_PAD:
+            // The field before is followed by spaces up to count bytes.
+            while (pos < field_start + count && pos < length && text[pos] == ' ')
+                pos++;
+            if (pos != field_start + count)
+                return 0;
+            break;
+
+        default:
+        {
+            field_start = pos;
+            int matched = parse_field(tag, count, is_abutting(compiledPattern, i), text, length, &pos, &fields, names, timezone, offset, output);
+            if (matched <= 0)
+                return matched;
+        }
+        }
+    }
+
+    if (!fields_to_epoch(&fields, offset, local, parsed))
+    {
+        return 0;
+    }
+
+    parsed->length = pos;
+    return 1;
+}
+
+int dtf_parse(buffer_t *compiledPattern, const char *text, size_t length, const char *locale, int offset, const char *timezone, int local, parsed_t *parsed, char *output)
+{
+    const locale_names_t *names = locale_names(locale);
+
+    if (names == NULL)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to set the \"%s\" locale.", locale);
+        return -1;
+    }
+
+    return parse_compiled(compiledPattern, text, length, names, offset, timezone, local, parsed, output);
+}
+
+int matcher_step(dtf_matcher_t *m, int parent, int tag, int count, bool abutting, int pattern)
+{
+    // The child of parent for the step, added at the end of its children
+    // when there is none yet; patterns come in order, so the children stay
+    // by increasing first.
+    int last = -1;
+
+    for (int c = m->nodes[parent].child; c >= 0; c = m->nodes[c].sibling)
+    {
+        matcher_node_t *node = m->nodes + c;
+        if (node->tag == tag && node->count == count && node->abutting == abutting)
+        {
+            return c;
+        }
+        last = c;
+    }
+
+    if (m->length == m->size)
+    {
+        m->size *= 2;
+        m->nodes = (matcher_node_t *)realloc(m->nodes, sizeof(matcher_node_t) * m->size);
+    }
+
+    int c = (int)m->length++;
+    matcher_node_t *node = m->nodes + c;
+    node->tag = tag;
+    node->count = count;
+    node->abutting = abutting;
+    node->pattern = -1;
+    node->first = pattern;
+    node->child = -1;
+    node->sibling = -1;
+
+    if (last < 0)
+    {
+        m->nodes[parent].child = c;
+    }
+    else
+    {
+        m->nodes[last].sibling = c;
+    }
+    return c;
+}
+
+int dtf_matcher_compile(const char **patterns, int n, dtf_matcher_t **matcherRef, char *error)
+{
+    // The patterns become paths of steps from the root, literals byte by
+    // byte, so that the patterns sharing a prefix share its nodes and
+    // parsing walks that prefix once for all of them.
+    dtf_matcher_t *m = (dtf_matcher_t *)malloc(sizeof(dtf_matcher_t));
+    m->size = 64;
+    m->length = 1;
+    m->nodes = (matcher_node_t *)malloc(sizeof(matcher_node_t) * m->size);
+    m->npatterns = n;
+    m->nodes[0] = (matcher_node_t){-1, 0, false, -1, 0, -1, -1};
+
+    for (int k = 0; k < n; k++)
+    {
+        buffer_t *compiledPattern = NULL;
+
+        if (compile_pattern(patterns[k], &compiledPattern, error))
+        {
+            dtf_matcher_free(m);
+            return 1;
+        }
+
+        int node = 0, tag, count;
+
+        for (int i = 0; i < compiledPattern->length;)
+        {
+            i = next_tag(compiledPattern, i, &tag, &count);
+
+            switch (tag)
+            {
+            case TAG_QUOTE_ASCII_CHAR:
+                node = matcher_step(m, node, TAG_QUOTE_ASCII_CHAR, count, false, k);
+                break;
+
+            case TAG_QUOTE_CHARS:
+            {
+                const unsigned char *bytes = (const unsigned char *)(compiledPattern->buffer + i);
+                for (int b = 0; b < count; b++)
+                {
+                    node = matcher_step(m, node, TAG_QUOTE_ASCII_CHAR, bytes[b], false, k);
+                }
+                i += QUOTE_CELLS(count);
+                break;
+            }
+
+            case TAG_DAY_SEGMENT:
+            case TAG_KERNEL:
+                break;
+
+            case TAG_PAD:
+                node = matcher_step(m, node, TAG_PAD, count, false, k);
+                break;
+
+            default:
+                node = matcher_step(m, node, tag, count, is_abutting(compiledPattern, i), k);
+            }
+        }
+
+        if (m->nodes[node].pattern < 0)
+        {
+            m->nodes[node].pattern = k;
+        }
+        free_buffer(compiledPattern);
+    }
+
+    *matcherRef = m;
+    return 0;
+}
+
+void dtf_matcher_free(dtf_matcher_t *m)
+{
+    if (m != NULL)
+    {
+        free(m->nodes);
+        free(m);
+    }
+}
+
+typedef struct matcher_walk_s
+{
+    const dtf_matcher_t *matcher;
+    const char *text;
+    size_t length;
+    const locale_names_t *names;
+    int offset;
+    const char *timezone;
+    int local;
+    int found;  // the lowest pattern matched so far, npatterns if none.
+    parsed_t *parsed;
+    char *output;
+} matcher_walk_t;
+
+void matcher_found(matcher_walk_t *w, int pattern, size_t pos, const fields_t *fields)
+{
+    fields_t done = *fields;
+    parsed_t parsed;
+
+    if (fields_to_epoch(&done, w->offset, w->local, &parsed))
+    {
+        parsed.length = pos;
+        *w->parsed = parsed;
+        w->found = pattern;
+    }
+}
+
+int matcher_walk(matcher_walk_t *w, int parent, size_t pos, size_t field_start, const fields_t *fields)
+{
+    // Depth first, children by increasing lowest pattern, so that a subtree
+    // is skipped once a pattern before all of its patterns has matched.
+    const matcher_node_t *nodes = w->matcher->nodes;
+
+    for (int c = nodes[parent].child; c >= 0 && nodes[c].first < w->found; c = nodes[c].sibling)
+    {
+        const matcher_node_t *node = nodes + c;
+        size_t p = pos, start = field_start;
+        const fields_t *next = fields;
+        fields_t f;
+
+        switch (node->tag)
+        {
+        case TAG_QUOTE_ASCII_CHAR:
+            if (p >= w->length || (unsigned char)w->text[p] != node->count)
+                continue;
+            p++;
+            break;
+
+        case TAG_PAD:
+            while (p < start + node->count && p < w->length && w->text[p] == ' ')
+                p++;
+            if (p != start + node->count)
+                continue;
+            break;
+
+        default:
+        {
+            start = p;
+            f = *fields;
+            next = &f;
+            int matched = parse_field(node->tag, node->count, node->abutting, w->text, w->length, &p, &f,
+                                      w->names, w->timezone, w->offset, w->output);
+            if (matched < 0)
+                return -1;
+            if (matched == 0)
+                continue;
+        }
+        }
+
+        if (node->pattern >= 0 && node->pattern < w->found)
+        {
+            matcher_found(w, node->pattern, p, next);
+        }
+
+        if (matcher_walk(w, c, p, start, next) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int dtf_matcher_parse(const dtf_matcher_t *matcher, const char *text, size_t length, const char *locale, int offset,
+                      const char *timezone, int local, int *pattern, parsed_t *parsed, char *output)
+{
+    // The same answer as dtf_parse with the patterns tried in order: the
+    // first pattern matching the start of the text, its index in *pattern.
+    const locale_names_t *names = locale_names(locale);
+
+    if (names == NULL)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to set the \"%s\" locale.", locale);
+        return -1;
+    }
+
+    matcher_walk_t w = {matcher, text, length, names, offset, timezone, local, matcher->npatterns, parsed, output};
+    fields_t fields;
+    init_fields(&fields);
+
+    if (matcher->nodes[0].pattern >= 0)
+    {
+        matcher_found(&w, matcher->nodes[0].pattern, 0, &fields);
+    }
+
+    if (matcher_walk(&w, 0, 0, 0, &fields) < 0)
+    {
+        return -1;
+    }
+
+    if (w.found == matcher->npatterns)
+    {
+        return 0;
+    }
+
+    *pattern = w.found;
+    return 1;
+}
+
+void split_units(int64_t value, long units_per_second, time_t *timer, long *nanos)
+{
+    int64_t seconds = value / units_per_second, units = value % units_per_second;
+    if (units < 0)
+    {
+        seconds--;
+        units += units_per_second;
+    }
+    *timer = (time_t)seconds;
+    *nanos = (long)(units * (NANOS_PER_SECOND / units_per_second));
+}
+
+int dtf_format_batch(const dtf_formatter_t *f, const int64_t *values, size_t n, long units_per_second, strbuffer_t *data, int64_t *offsets, char *output)
+{
+    time_t timer;
+    long nanos;
+
+    offsets[0] = data->length;
+    for (size_t i = 0; i < n; i++)
+    {
+        split_units(values[i], units_per_second, &timer, &nanos);
+        if (dtf_formatbn(f->compiled, timer, nanos, f->locale, f->offset, f->timezone, f->local, data, output))
+        {
+            return 1;
+        }
+        offsets[i + 1] = data->length;
+    }
+    return 0;
+}
+
+typedef struct batch_block_s
+{
+    int worker;    // whose slab holds the rendering of the block.
+    size_t start;  // where the block begins in that slab.
+    size_t length;
+} batch_block_t;
+
+typedef struct batch_worker_s
+{
+    pthread_mutex_t mutex; // guards next and end, that thieves shrink from the back.
+    size_t next, end;      // blocks still owned by this worker.
+    strbuffer_t slab;
+    char error[ERROR_BUFFER_LENGTH];
+} batch_worker_t;
+
+typedef struct batch_s
+{
+    const dtf_formatter_t *formatter;
+    const int64_t *values;
+    size_t n;
+    long units_per_second;
+    int64_t *offsets;
+    batch_block_t *blocks;
+    size_t nblocks;
+    batch_worker_t *workers;
+    int nworkers;
+    _Atomic int failed; // the index of the first failed worker plus one.
+} batch_t;
+
+int batch_take(batch_t *batch, int w, size_t *block)
+{
+    // Own blocks are taken from the front, stolen ones from the back of a victim.
+    for (int k = 0; k < batch->nworkers; k++)
+    {
+        batch_worker_t *victim = batch->workers + (w + k) % batch->nworkers;
+        int taken = 0;
+
+        pthread_mutex_lock(&victim->mutex);
+        if (victim->next < victim->end)
+        {
+            *block = k == 0 ? victim->next++ : --victim->end;
+            taken = 1;
+        }
+        pthread_mutex_unlock(&victim->mutex);
+
+        if (taken)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void batch_task(void *arg, int w)
+{
+    batch_t *batch = (batch_t *)arg;
+    batch_worker_t *worker = batch->workers + w;
+    const dtf_formatter_t *f = batch->formatter;
+    size_t b;
+
+    while (!batch->failed && batch_take(batch, w, &b))
+    {
+        size_t from = b * BATCH_BLOCK_ROWS, to = from + BATCH_BLOCK_ROWS < batch->n ? from + BATCH_BLOCK_ROWS : batch->n;
+        time_t timer;
+        long nanos;
+
+        batch->blocks[b].worker = w;
+        batch->blocks[b].start = worker->slab.length;
+
+        for (size_t i = from; i < to; i++)
+        {
+            split_units(batch->values[i], batch->units_per_second, &timer, &nanos);
+            if (dtf_formatbn(f->compiled, timer, nanos, f->locale, f->offset, f->timezone, f->local, &worker->slab, worker->error))
+            {
+                int none = 0;
+                atomic_compare_exchange_strong(&batch->failed, &none, w + 1);
+                return;
+            }
+            batch->offsets[i + 1] = worker->slab.length; // relative to the slab, fixed when stitching.
+        }
+
+        batch->blocks[b].length = worker->slab.length - batch->blocks[b].start;
+    }
+}
+
+// A job of the built-in executor, on the stack of its caller while queued.
+typedef struct pool_job_s
+{
+    dtf_task_t task;
+    void *arg;
+    int ntasks;
+    int next; // the next task index to run.
+    int running;
+    struct pool_job_s *next_job;
+} pool_job_t;
+
+// The jobs of every caller share one queue, oldest first, and the threads
+// take their tasks in turn. Tasks are coarse: the batch functions start one
+// per worker and the workers steal blocks of rows from each other.
+typedef struct pool_s
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t work, done;
+    pthread_t threads[POOL_MAX_THREADS];
+    int nthreads;
+    pool_job_t *jobs;
+} pool_t;
+
+static pool_t pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static _Thread_local int pool_inside = 0; // running a task of the pool.
+
+int pool_run_one(pool_job_t *job)
+{
+    // Called with pool.mutex held, runs one task of the job if any is left.
+    if (job->next >= job->ntasks)
+    {
+        return 0;
+    }
+
+    int index = job->next++;
+    job->running++;
+    pthread_mutex_unlock(&pool.mutex);
+
+    int outer = pool_inside;
+    pool_inside = 1;
+    job->task(job->arg, index);
+    pool_inside = outer;
+
+    pthread_mutex_lock(&pool.mutex);
+    if (--job->running == 0 && job->next >= job->ntasks)
+    {
+        pthread_cond_broadcast(&pool.done);
+    }
+    return 1;
+}
+
+void *pool_thread(void *unused)
+{
+    pthread_mutex_lock(&pool.mutex);
+    for (;;)
+    {
+        pool_job_t *job = pool.jobs;
+        while (job != NULL && job->next >= job->ntasks)
+        {
+            job = job->next_job;
+        }
+
+        if (job == NULL)
+        {
+            pthread_cond_wait(&pool.work, &pool.mutex);
+        }
+        else
+        {
+            pool_run_one(job);
+        }
+    }
+    return NULL;
+}
+
+void dtf_pool_executor(dtf_task_t task, void *arg, int ntasks, void *executor_data)
+{
+    // The built-in executor: a pool of threads that are started on demand
+    // and live as long as the process, so that their caches stay warm.
+    if (pool_inside)
+    {
+        // From a task: the pool may be all taken by the outer jobs, the
+        // tasks run here, the batch workers steal each other's blocks.
+        for (int index = 0; index < ntasks; index++)
+        {
+            task(arg, index);
+        }
+        return;
+    }
+
+    pool_job_t job = {task, arg, ntasks, 0, 0, NULL};
+
+    pthread_mutex_lock(&pool.mutex);
+
+    while (pool.nthreads < ntasks - 1 && pool.nthreads < POOL_MAX_THREADS)
+    {
+        if (pthread_create(pool.threads + pool.nthreads, NULL, pool_thread, NULL) != 0)
+        {
+            break;
+        }
+        pthread_detach(pool.threads[pool.nthreads]);
+        pool.nthreads++;
+    }
+
+    pool_job_t **last = &pool.jobs;
+    while (*last != NULL)
+    {
+        last = &(*last)->next_job;
+    }
+    *last = &job;
+    pthread_cond_broadcast(&pool.work);
+
+    while (pool_run_one(&job)) // the caller works on its own job too.
+        ;
+
+    while (job.running > 0)
+    {
+        pthread_cond_wait(&pool.done, &pool.mutex);
+    }
+
+    for (last = &pool.jobs; *last != &job; last = &(*last)->next_job)
+        ;
+    *last = job.next_job;
+
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+int dtf_format_batch_parallel(const dtf_formatter_t *f, const int64_t *values, size_t n, long units_per_second, int nthreads,
+                              dtf_executor_t executor, void *executor_data, strbuffer_t *data, int64_t *offsets, char *output)
+{
+    size_t nblocks = (n + BATCH_BLOCK_ROWS - 1) / BATCH_BLOCK_ROWS;
+
+    if (nthreads > (int)nblocks)
+    {
+        nthreads = (int)nblocks;
+    }
+
+    if (nthreads <= 1)
+    {
+        return dtf_format_batch(f, values, n, units_per_second, data, offsets, output);
+    }
+
+    if (executor == NULL)
+    {
+        executor = dtf_pool_executor;
+    }
+
+    batch_t batch;
+    batch.formatter = f;
+    batch.values = values;
+    batch.n = n;
+    batch.units_per_second = units_per_second;
+    batch.offsets = offsets;
+    batch.nblocks = nblocks;
+    batch.nworkers = nthreads;
+    batch.failed = 0;
+    batch.blocks = (batch_block_t *)malloc(nblocks * sizeof(batch_block_t));
+    batch.workers = (batch_worker_t *)malloc(nthreads * sizeof(batch_worker_t));
+
+    if (batch.blocks == NULL || batch.workers == NULL)
+    {
+        free(batch.blocks);
+        free(batch.workers);
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to allocate the batch of %zu values.", n);
+        return 1;
+    }
+
+    for (int w = 0; w < nthreads; w++)
+    {
+        batch_worker_t *worker = batch.workers + w;
+        pthread_mutex_init(&worker->mutex, NULL);
+        worker->next = nblocks * w / nthreads;
+        worker->end = nblocks * (w + 1) / nthreads;
+        init_strbuffer(&worker->slab);
+    }
+
+    executor(batch_task, &batch, nthreads, executor_data);
+
+    int failed = batch.failed != 0;
+
+    if (failed)
+    {
+        strcpy(output, batch.workers[batch.failed - 1].error);
+    }
+    else
+    {
+        // Stitch the slabs in block order into one contiguous data buffer.
+        size_t total = 0;
+        for (size_t b = 0; b < nblocks; b++)
+        {
+            total += batch.blocks[b].length;
+        }
+
+        char *p = reserve_strbuffer(data, total);
+        if (p == NULL)
+        {
+            snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to allocate %zu bytes for the batch.", total);
+            failed = 1;
+        }
+        else
+        {
+            offsets[0] = data->length;
+            for (size_t b = 0; b < nblocks; b++)
+            {
+                batch_block_t *block = batch.blocks + b;
+                int64_t shift = (int64_t)data->length - (int64_t)block->start;
+                size_t from = b * BATCH_BLOCK_ROWS, to = from + BATCH_BLOCK_ROWS < n ? from + BATCH_BLOCK_ROWS : n;
+
+                memcpy(data->buffer + data->length, batch.workers[block->worker].slab.buffer + block->start, block->length);
+                data->length += block->length;
+
+                for (size_t i = from; i < to; i++)
+                {
+                    offsets[i + 1] += shift;
+                }
+            }
+        }
+    }
+
+    for (int w = 0; w < nthreads; w++)
+    {
+        pthread_mutex_destroy(&batch.workers[w].mutex);
+        free_strbuffer(&batch.workers[w].slab);
+    }
+    free(batch.workers);
+    free(batch.blocks);
+
+    return failed;
+}
+
+void build_parse_plan(buffer_t *compiledPattern, parse_plan_t *plan)
+{
+    // Numeric fields take count digits and literals their bytes, so a
+    // text of exactly that shape can be checked position by position; any
+    // other text goes to the generic parser, which decides if it matches.
+    size_t at = 0;
+    int tag, count;
+
+    plan->width = 0;
+    plan->nfields = 0;
+
+    for (int i = 0; i < compiledPattern->length;)
+    {
+        i = next_tag(compiledPattern, i, &tag, &count);
+
+        switch (tag)
+        {
+        case TAG_QUOTE_ASCII_CHAR:
+            if (at + 1 > PARSE_PLAN_WIDTH)
+                return;
+            plan->lo[at] = plan->hi[at] = (unsigned char)count;
+            at++;
+            break;
+
+        case TAG_QUOTE_CHARS:
+            if (at + count > PARSE_PLAN_WIDTH)
+                return;
+            memcpy(plan->lo + at, compiledPattern->buffer + i, count);
+            memcpy(plan->hi + at, compiledPattern->buffer + i, count);
+            at += count;
+            i += QUOTE_CELLS(count);
+            break;
+
+        case TAG_DAY_SEGMENT:
+        case TAG_KERNEL:
+            break;
+
+        default:
+            // Names, zones and pads make the shape vary; more than 9 digits
+            // are more than the generic parser reads.
+            if (!is_numeric_field(tag, count) || count > 9 || plan->nfields == PARSE_PLAN_FIELDS ||
+                at + count > PARSE_PLAN_WIDTH)
+                return;
+            memset(plan->lo + at, '0', count);
+            memset(plan->hi + at, '9', count);
+            plan->fields[plan->nfields++] = (parse_plan_field_t){tag, count, at};
+            at += count;
+        }
+    }
+
+    plan->width = at;
+}
+
+int parse_planned(const parse_plan_t *plan, const char *text, const locale_names_t *names, int offset,
+                  const char *timezone, int local, parsed_t *parsed, char *output)
+{
+    // 1 if the plan->width bytes of text have the shape and parse, else 0
+    // and the generic parser gets the last word.
+    const unsigned char *t = (const unsigned char *)text;
+    unsigned char bad = 0;
+
+    for (size_t k = 0; k < plan->width; k++)
+    {
+        bad |= (t[k] < plan->lo[k]) | (t[k] > plan->hi[k]);
+    }
+
+    if (bad)
+    {
+        return 0;
+    }
+
+    fields_t fields;
+    init_fields(&fields);
+
+    for (int k = 0; k < plan->nfields; k++)
+    {
+        const parse_plan_field_t *field = plan->fields + k;
+        long value = 0;
+
+        for (int d = 0; d < field->count; d++)
+        {
+            value = value * 10 + (t[field->at + d] - '0');
+        }
+
+        // The usual fields go straight in, with the bounds of parse_field;
+        // the others through it, as abutting so that it takes the digits.
+        switch (field->tag)
+        {
+        case PATTERN_YEAR:
+            fields.year = value;
+            fields.ambiguous_year = field->count == 2;
+            break;
+        case PATTERN_MONTH:
+            if (value < 1 || value > 12)
+                return 0;
+            fields.month = (int)value;
+            break;
+        case PATTERN_DAY_OF_MONTH:
+            if (value < 1 || value > 31)
+                return 0;
+            fields.day = (int)value;
+            break;
+        case PATTERN_HOUR_OF_DAY0:
+            if (value > 24)
+                return 0;
+            fields.hour = (int)(value % 24);
+            break;
+        case PATTERN_MINUTE:
+            if (value > 59)
+                return 0;
+            fields.minute = (int)value;
+            break;
+        case PATTERN_SECOND:
+            if (value > 60)
+                return 0;
+            fields.second = (int)value;
+            break;
+        case PATTERN_MILLISECOND:
+            if (value > 999)
+                return 0;
+            fields.nanos = value * 1000000;
+            break;
+        default:
+        {
+            size_t pos = field->at;
+            if (parse_field(field->tag, field->count, true, text, plan->width, &pos, &fields, names, timezone, offset, output) != 1)
+                return 0;
+        }
+        }
+    }
+
+    if (!fields_to_epoch(&fields, offset, local, parsed))
+    {
+        return 0;
+    }
+
+    parsed->length = plan->width;
+    return 1;
+}
+
+int parse_rows(const dtf_formatter_t *f, const parse_plan_t *plan, const locale_names_t *names, const char *data,
+               const int64_t *offsets, size_t from, size_t to, long units_per_second, int64_t *out, uint8_t *valid, char *output)
+{
+    // Rows [from, to), from a multiple of 8; a row is valid when the whole
+    // text matches the pattern.
+    long nanos_per_unit = NANOS_PER_SECOND / units_per_second;
+
+    memset(valid + from / 8, 0, (to - from + 7) / 8);
+
+    for (size_t i = from; i < to; i++)
+    {
+        const char *text = data + offsets[i];
+        size_t length = (size_t)(offsets[i + 1] - offsets[i]);
+        parsed_t parsed;
+        int matched = 0;
+
+        if (plan->width > 0 && length == plan->width)
+        {
+            matched = parse_planned(plan, text, names, f->offset, f->timezone, f->local, &parsed, output);
+        }
+
+        if (!matched)
+        {
+            matched = parse_compiled(f->compiled, text, length, names, f->offset, f->timezone, f->local, &parsed, output);
+            if (matched < 0)
+            {
+                return 1;
+            }
+        }
+
+        if (matched && parsed.length == length)
+        {
+            out[i] = (int64_t)parsed.timer * units_per_second + parsed.nanos / nanos_per_unit;
+            valid[i / 8] |= 1 << (i % 8);
+        }
+        else
+        {
+            out[i] = 0;
+        }
+    }
+
+    return 0;
+}
+
+int dtf_parse_batch(const dtf_formatter_t *f, const char *data, const int64_t *offsets, size_t n, long units_per_second,
+                    int64_t *out, uint8_t *valid, char *output)
+{
+    // The texts are data[offsets[i], offsets[i + 1]), as dtf_format_batch
+    // writes them. The epochs are in units_per_second, bit i % 8 of
+    // valid[i / 8] tells if the text of row i matched, 0 in out if not.
+    const locale_names_t *names = locale_names(f->locale);
+    parse_plan_t plan;
+
+    if (names == NULL)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to set the \"%s\" locale.", f->locale);
+        return 1;
+    }
+
+    build_parse_plan(f->compiled, &plan);
+    return parse_rows(f, &plan, names, data, offsets, 0, n, units_per_second, out, valid, output);
+}
+
+typedef struct parse_batch_s
+{
+    const dtf_formatter_t *formatter;
+    const parse_plan_t *plan;
+    const locale_names_t *names;
+    const char *data;
+    const int64_t *offsets;
+    size_t n;
+    long units_per_second;
+    int64_t *out;
+    uint8_t *valid;
+    size_t nblocks;
+    int nworkers;
+    _Atomic int failed; // the index of the first failed worker plus one.
+    char (*errors)[ERROR_BUFFER_LENGTH];
+} parse_batch_t;
+
+void parse_batch_task(void *arg, int w)
+{
+    // Parsing costs about the same for every row, so the workers take
+    // contiguous runs of blocks and nobody steals.
+    parse_batch_t *batch = (parse_batch_t *)arg;
+    size_t from = batch->nblocks * w / batch->nworkers * BATCH_BLOCK_ROWS;
+    size_t to = batch->nblocks * (w + 1) / batch->nworkers * BATCH_BLOCK_ROWS;
+
+    if (to > batch->n)
+    {
+        to = batch->n;
+    }
+
+    if (from < to && parse_rows(batch->formatter, batch->plan, batch->names, batch->data, batch->offsets, from, to,
+                                batch->units_per_second, batch->out, batch->valid, batch->errors[w]))
+    {
+        int none = 0;
+        atomic_compare_exchange_strong(&batch->failed, &none, w + 1);
+    }
+}
+
+int dtf_parse_batch_parallel(const dtf_formatter_t *f, const char *data, const int64_t *offsets, size_t n, long units_per_second,
+                             int nthreads, dtf_executor_t executor, void *executor_data, int64_t *out, uint8_t *valid, char *output)
+{
+    size_t nblocks = (n + BATCH_BLOCK_ROWS - 1) / BATCH_BLOCK_ROWS;
+
+    if (nthreads > (int)nblocks)
+    {
+        nthreads = (int)nblocks;
+    }
+
+    if (nthreads <= 1)
+    {
+        return dtf_parse_batch(f, data, offsets, n, units_per_second, out, valid, output);
+    }
+
+    if (executor == NULL)
+    {
+        executor = dtf_pool_executor;
+    }
+
+    const locale_names_t *names = locale_names(f->locale);
+    parse_plan_t plan;
+
+    if (names == NULL)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to set the \"%s\" locale.", f->locale);
+        return 1;
+    }
+
+    build_parse_plan(f->compiled, &plan);
+
+    parse_batch_t batch;
+    batch.formatter = f;
+    batch.plan = &plan;
+    batch.names = names;
+    batch.data = data;
+    batch.offsets = offsets;
+    batch.n = n;
+    batch.units_per_second = units_per_second;
+    batch.out = out;
+    batch.valid = valid;
+    batch.nblocks = nblocks;
+    batch.nworkers = nthreads;
+    batch.failed = 0;
+    batch.errors = malloc(nthreads * sizeof(*batch.errors));
+
+    if (batch.errors == NULL)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to allocate the batch of %zu texts.", n);
+        return 1;
+    }
+
+    executor(parse_batch_task, &batch, nthreads, executor_data);
+
+    int failed = batch.failed != 0;
+    if (failed)
+    {
+        strcpy(output, batch.errors[batch.failed - 1]);
+    }
+
+    free(batch.errors);
+    return failed;
+}
+
+int line_timestamp(const dtf_formatter_t *f, const locale_names_t *names, const char *line, size_t length,
+                   size_t window, parsed_t *parsed, char *output)
+{
+    // The first match of the pattern starting within window bytes of the line.
+    if (window > length)
+    {
+        window = length;
+    }
+
+    for (size_t start = 0; start < window; start++)
+    {
+        int matched = parse_compiled(f->compiled, line + start, length - start, names, f->offset, f->timezone, f->local, parsed, output);
+        if (matched != 0)
+        {
+            return matched;
+        }
+    }
+    return 0;
+}
+
+int seek_stamped_line(const dtf_formatter_t *f, const locale_names_t *names, const char *data, size_t size,
+                      size_t from, size_t to, size_t window, size_t skip, size_t *line, time_t *timer, char *output)
+{
+    // The first line from the line start from on with a timestamp, 1 and its
+    // start in line, 0 if none starts before to, -1 on errors or if none is
+    // found within skip bytes.
+    for (size_t p = from; p < to;)
+    {
+        const char *newline = memchr(data + p, '\n', size - p);
+        size_t length = newline != NULL ? (size_t)(newline - data) - p : size - p;
+        parsed_t parsed;
+
+        int matched = line_timestamp(f, names, data + p, length, window, &parsed, output);
+        if (matched < 0)
+        {
+            return -1;
+        }
+        if (matched)
+        {
+            *line = p;
+            *timer = parsed.timer;
+            return 1;
+        }
+
+        p += length + 1;
+        if (p - from > skip && p < to)
+        {
+            snprintf(output, ERROR_BUFFER_LENGTH, "No timestamp in the %zu bytes after offset %zu.", skip, from);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int seek_time(const dtf_formatter_t *f, const locale_names_t *names, const char *data, size_t size,
+              size_t window, size_t skip, time_t target, size_t *offset, char *output)
+{
+    // Binary search of the first line with a timestamp at or after target.
+    // The lines before lo with a timestamp are all before target, those from
+    // hi on are all at or after it; lo is a line start. Lines without one,
+    // as the continuations of a stack trace, go with the line before.
+    size_t lo = 0, hi = size, line;
+    time_t timer;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2, start = lo;
+
+        if (mid > lo)
+        {
+            const char *newline = memchr(data + mid - 1, '\n', hi - mid + 1);
+            if (newline != NULL && (size_t)(newline - data) + 1 < hi)
+            {
+                start = (size_t)(newline - data) + 1;
+            }
+        }
+
+        int found = seek_stamped_line(f, names, data, size, start, hi, window, skip, &line, &timer, output);
+        if (found < 0)
+        {
+            return 1;
+        }
+
+        if (found && timer < target)
+        {
+            const char *newline = memchr(data + line, '\n', size - line);
+            lo = newline != NULL ? (size_t)(newline - data) + 1 : size;
+        }
+        else
+        {
+            hi = start;
+        }
+    }
+
+    // From the end of the lines before target to the first line after it.
+    int found = seek_stamped_line(f, names, data, size, lo, size, window, skip, &line, &timer, output);
+    if (found < 0)
+    {
+        return 1;
+    }
+
+    *offset = found ? line : size;
+    return 0;
+}
+
+int dtf_seek(const dtf_formatter_t *f, const char *data, size_t size, size_t window, size_t skip,
+             time_t from, time_t to, size_t *begin, size_t *end, char *output)
+{
+    // The bytes [begin, end) of a log sorted by time hold the lines stamped
+    // in [from, to), with the lines without a timestamp that follow them.
+    // The timestamp starts within window bytes of a line, and a probe scans
+    // at most skip bytes of lines without one; each bound takes O(log size)
+    // probes.
+    const locale_names_t *names = locale_names(f->locale);
+
+    if (names == NULL)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to set the \"%s\" locale.", f->locale);
+        return 1;
+    }
+
+    if (seek_time(f, names, data, size, window, skip, from, begin, output))
+    {
+        return 1;
+    }
+
+    if (to <= from)
+    {
+        *end = *begin;
+        return 0;
+    }
+
+    // The end is at or after the beginning, only the rest is searched.
+    if (seek_time(f, names, data + *begin, size - *begin, window, skip, to, end, output))
+    {
+        return 1;
+    }
+
+    *end += *begin;
+    return 0;
+}
+
+int advance_tm(tm_t *tm, time_t timer, long nanos, char *output)
+{
+    // Moves a calendar to another instant, keeping its civil fields while
+    // the local day doesn't change; time of day fields need only seconds.
+    if (tm->localtime)
+    {
+        const zone_period_t *period = local_zone_period(timer);
+        if (period == NULL)
+        {
+            snprintf(output, ERROR_BUFFER_LENGTH, "Impossible to get the local time of %ld.", (long)timer);
+            return 1;
+        }
+
+        tm->zone_offset = period->offset;
+        tm->isdst = period->isdst;
+        tm->zone_name = period->name;
+    }
+
+    time_t local = timer + tm->zone_offset;
+    long day = floorDiv(local, 86400);
+
+    if (day != tm->day)
+    {
+        tm->civil = 0;
+        tm->day = day;
+    }
+
+    tm->timer = local;
+    tm->seconds = (int)(local - day * 86400);
+    tm->nanos = (int)nanos;
+
+    return 0;
+}
+
+int read_varint(const unsigned char *data, size_t size, size_t *pos, uint64_t *value)
+{
+    uint64_t v = 0;
+
+    for (int shift = 0; shift < 64 && *pos < size; shift += 7)
+    {
+        unsigned char b = data[(*pos)++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (b < 0x80)
+        {
+            *value = v;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int read_zigzag(const unsigned char *data, size_t size, size_t *pos, int64_t *value)
+{
+    uint64_t v;
+
+    if (read_varint(data, size, pos, &v))
+    {
+        return 1;
+    }
+    *value = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    return 0;
+}
+
+int dtf_format_column(const dtf_formatter_t *f, int encoding, const unsigned char *column, size_t size, long units_per_second,
+                      char separator, strbuffer_t *data, size_t *n, char *output)
+{
+    // Decodes and formats in one pass: consecutive values are close, so the
+    // calendar is advanced rather than rebuilt and stays on the same day.
+    tm_t tm;
+    time_t timer;
+    long nanos;
+    size_t pos = 0;
+    int64_t value = 0, delta = 0;
+
+    *n = 0;
+
+    if (init_tm(&tm, 0, 0, f->locale, f->offset, f->timezone, f->local, output))
+    {
+        return 1;
+    }
+
+    while (pos < size)
+    {
+        size_t at = pos;
+        uint64_t count = 1;
+        int64_t base = 0;
+        int width = 0;
+        size_t bit = 0;
+
+        switch (encoding)
+        {
+        case DTF_COLUMN_DELTA:
+            if (read_zigzag(column, size, &pos, &delta))
+                goto truncated;
+            value = *n == 0 ? delta : (int64_t)((uint64_t)value + (uint64_t)delta); // wraps as the encoder does.
+            break;
+
+        case DTF_COLUMN_DELTA_OF_DELTA:
+            if (read_zigzag(column, size, &pos, &base))
+                goto truncated;
+            if (*n == 0)
+                value = base;
+            else
+            {
+                delta = *n == 1 ? base : (int64_t)((uint64_t)delta + (uint64_t)base);
+                value = (int64_t)((uint64_t)value + (uint64_t)delta);
+            }
+            break;
+
+        case DTF_COLUMN_FOR:
+            if (read_zigzag(column, size, &pos, &base) || read_varint(column, size, &pos, &count) || pos >= size)
+                goto truncated;
+            width = column[pos++];
+            if (width > 64)
+            {
+                snprintf(output, ERROR_BUFFER_LENGTH, "Invalid bit width %d of the block at byte %zu.", width, at);
+                return 1;
+            }
+            if (count > DTF_COLUMN_MAX_BLOCK_ROWS || (width > 0 && count > (size - pos) * 8 / width))
+            {
+                snprintf(output, ERROR_BUFFER_LENGTH, "Truncated/invalid block of %llu rows at byte %zu.",
+                         (unsigned long long)count, at);
+                return 1;
+            }
+            break;
+
+        default:
+            snprintf(output, ERROR_BUFFER_LENGTH, "Unknown column encoding %d.", encoding);
+            return 1;
+        }
+
+        for (uint64_t k = 0; k < count; k++)
+        {
+            if (encoding == DTF_COLUMN_FOR)
+            {
+                // Offsets from the base, packed in width bits least significant first.
+                uint64_t offset = 0;
+                for (int b = 0; b < width; b++, bit++)
+                {
+                    offset |= (uint64_t)(column[pos + bit / 8] >> (bit % 8) & 1) << b;
+                }
+                value = (int64_t)((uint64_t)base + offset);
+            }
+
+            split_units(value, units_per_second, &timer, &nanos);
+
+            if (advance_tm(&tm, timer, nanos, output) ||
+                format_range(f->compiled, 0, f->compiled->length, &tm, data, output))
+            {
+                return 1;
+            }
+            add_strchar(data, separator);
+            (*n)++;
+        }
+
+        pos += (bit + 7) / 8;
+    }
+
+    return 0;
+
+truncated:
+    snprintf(output, ERROR_BUFFER_LENGTH, "Truncated column at byte %zu.", pos);
+    return 1;
+}
+
+int dtf_format_fixed(const dtf_formatter_t *f, const int64_t *values, size_t n, long units_per_second, char *records, size_t *width, char *output)
+{
+    // Record i is at i * width with no separator, for a pattern compiled by
+    // dtf_compile_fixed; records that would be of another width are errors.
+    dtf_pattern_info_t info;
+    tm_t tm;
+    strbuffer_t b;
+
+    if (dtf_pattern_info(f->compiled, &info, output))
+    {
+        return 1;
+    }
+
+    if (!info.fixed_width)
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "The pattern isn't of fixed width, compile it with dtf_compile_fixed.");
+        return 1;
+    }
+
+    *width = info.max_length;
+
+    if (init_tm(&tm, 0, 0, f->locale, f->offset, f->timezone, f->local, output))
+    {
+        return 1;
+    }
+
+    init_strbuffer(&b);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        time_t timer;
+        long nanos;
+        split_units(values[i], units_per_second, &timer, &nanos);
+
+        b.length = 0;
+        if (advance_tm(&tm, timer, nanos, output) ||
+            format_range(f->compiled, 0, f->compiled->length, &tm, &b, output))
+        {
+            free_strbuffer(&b);
+            return 1;
+        }
+
+        if (b.length != *width)
+        {
+            snprintf(output, ERROR_BUFFER_LENGTH, "Record %zu is %zu bytes wide instead of %zu, years out of 1..9999 can't be fixed.",
+                     i, b.length, *width);
+            free_strbuffer(&b);
+            return 1;
+        }
 
-    case PATTERN_MONTH_STANDALONE: // 'L'
-    case PATTERN_MONTH:            // 'M' (context sensitive)
-        // if (useDateFormatSymbols)
+        memcpy(records + i * *width, b.buffer, b.length);
+    }
+
+    free_strbuffer(&b);
+    return 0;
+}
+
+int dtf_parse_fixed(const dtf_formatter_t *f, const char *records, size_t width, size_t i, parsed_t *parsed, char *output)
+{
+    int matched = dtf_parse(f->compiled, records + i * width, width, f->locale, f->offset, f->timezone, f->local, parsed, output);
+
+    if (matched == 1 && parsed->length != width)
+    {
+        return 0;
+    }
+    return matched;
+}
+
+bool is_packable(int tag, int count)
+{
+    switch (tag)
+    {
+    case PATTERN_YEAR:
+    case PATTERN_WEEK_YEAR:
+        return true; // years that don't fit are rejected when packed.
+    case PATTERN_MONTH:
+    case PATTERN_MONTH_STANDALONE:
+        return count == 2;
+    case PATTERN_DAY_OF_MONTH:
+    case PATTERN_HOUR_OF_DAY1:
+    case PATTERN_HOUR_OF_DAY0:
+    case PATTERN_MINUTE:
+    case PATTERN_SECOND:
+    case PATTERN_MILLISECOND:
+    case PATTERN_DAY_OF_YEAR:
+    case PATTERN_HOUR1:
+    case PATTERN_HOUR0:
+    case PATTERN_ISO_DAY_OF_WEEK:
+        return count >= PATTERN_MAX_DIGITS[tag];
+    default:
+        return false;
+    }
+}
+
+int packed_digits(buffer_t *compiledPattern, int bcd, int *digits, char *output)
+{
+    // Only numeric fields of a fixed number of digits and no literals, so
+    // the text is the decimal, or BCD, writing of a single integer.
+    int tag, count;
+    *digits = 0;
+
+    for (int i = 0; i < compiledPattern->length;)
+    {
+        i = next_tag(compiledPattern, i, &tag, &count);
+
+        if (tag == TAG_DAY_SEGMENT || tag == TAG_KERNEL)
         {
-            if (count >= 4)
-            {
-                // months = formatData.getMonths();
-                // current = months[value];
-                // calendar_getfield_at(L, date_table_index, "getMonths", value, &current);
+            continue;
+        }
 
-                strftime(strftime_buffer, STRFTIME_BUFFER_LENGTH, "%B", info);
-                current = strftime_buffer;
-            }
-            else if (count == 3)
+        if (!is_packable(tag, count))
+        {
+            snprintf(output, ERROR_BUFFER_LENGTH, "The pattern isn't made of fixed width numeric fields only.");
+            return 1;
+        }
+        *digits += count;
+    }
+
+    if (*digits > (bcd ? 16 : 19))
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "The pattern has %d digits, more than an uint64_t holds.", *digits);
+        return 1;
+    }
+    return 0;
+}
+
+int pack_fields(buffer_t *compiledPattern, tm_t *tm, int bcd, uint64_t *packed, char *output)
+{
+    uint64_t v = 0;
+    int tag, count, value;
+
+    for (int i = 0; i < compiledPattern->length;)
+    {
+        i = next_tag(compiledPattern, i, &tag, &count);
+
+        if (tag == TAG_DAY_SEGMENT || tag == TAG_KERNEL)
+        {
+            continue;
+        }
+
+        // The values subFormat prints for these letters.
+        int field = tag == PATTERN_WEEK_YEAR ? YEAR : PATTERN_INDEX_TO_CALENDAR_FIELD[tag];
+        if (calendar_get(tm, field, &value, output))
+        {
+            return 1;
+        }
+
+        if (tag == PATTERN_HOUR_OF_DAY1 && value == 0)
+            value = calendar_getMaximum(HOUR_OF_DAY) + 1;
+        else if (tag == PATTERN_HOUR1 && value == 0)
+            value = calendar_getLeastMaximum(HOUR) + 1;
+        else if (field == MONTH)
+            value++;
+        else if (field == YEAR && count == 2 && value >= 1000 && value < 10000)
+            value %= 100; // clip 1996 to 96
+
+        uint64_t limit = 1;
+        for (int k = 0; k < count; k++)
+        {
+            limit *= 10;
+        }
+
+        if (value < 0 || (uint64_t)value >= limit)
+        {
+            snprintf(output, ERROR_BUFFER_LENGTH, "The '%c' field value %d doesn't fit in %d digits.", patternChars[tag], value, count);
+            return 1;
+        }
+
+        if (bcd)
+        {
+            // A decimal digit per nibble, the most significant first.
+            uint64_t nibbles = 0;
+            for (int k = 0; k < count; k++, value /= 10)
             {
-                // months = formatData.getShortMonths();
-                // current = months[value];
-                // calendar_getfield_at(L, date_table_index, "getShortMonths", value, &current);
-                strftime(strftime_buffer, STRFTIME_BUFFER_LENGTH, "%b", info);
-                current = strftime_buffer;
+                nibbles |= (uint64_t)(value % 10) << (4 * k);
             }
+            v = v << (4 * count) | nibbles;
         }
-        // else
-        // {
-        //     if (count < 3)
-        //     {
-        //         current = NULL;
-        //     }
-        //     else if (forceStandaloneForm)
-        //     {
-        //         current = calendar.getDisplayName(field, style | 0x8000, locale);
-        //         if (current == NULL)
-        //         {
-        //             current = calendar.getDisplayName(field, style, locale);
-        //         }
-        //     }
-        // }
-        if (current == NULL)
+        else
         {
-            zeroPaddingNumber(L, value + 1, count, maxIntCount, buffer);
+            v = v * limit + value;
         }
-        break;
+    }
 
-        // case PATTERN_MONTH_STANDALONE: // 'L'
-        //     assert(current == NULL);
-        //     // if (locale == NULL)
-        //     {
-        //         const char **months;
-        //         if (count >= 4)
-        //         {
-        //             months = formatData.getMonths();
-        //             current = months[value];
-        //         }
-        //         else if (count == 3)
-        //         {
-        //             months = formatData.getShortMonths();
-        //             current = months[value];
-        //         }
-        //     }
-        //     // else
-        //     // {
-        //     //     if (count >= 3)
-        //     //     {
-        //     //         current = calendar.getDisplayName(field, style | 0x8000, locale);
-        //     //     }
-        //     // }
-        //     if (current == NULL)
-        //     {
-        //         zeroPaddingNumber(L, value + 1, count, maxIntCount, buffer);
-        //     }
-        //     break;
+    *packed = v;
+    return 0;
+}
+
+int dtf_format_packed(const dtf_formatter_t *f, time_t timer, long nanos, int bcd, uint64_t *packed, char *output)
+{
+    tm_t tm;
+    int digits;
+
+    if (packed_digits(f->compiled, bcd, &digits, output) ||
+        init_tm(&tm, timer, nanos, f->locale, f->offset, f->timezone, f->local, output))
+    {
+        return 1;
+    }
+
+    return pack_fields(f->compiled, &tm, bcd, packed, output);
+}
+
+int dtf_format_packed_batch(const dtf_formatter_t *f, const int64_t *values, size_t n, long units_per_second, int bcd, uint64_t *packed, char *output)
+{
+    tm_t tm;
+    int digits;
+
+    if (packed_digits(f->compiled, bcd, &digits, output) ||
+        init_tm(&tm, 0, 0, f->locale, f->offset, f->timezone, f->local, output))
+    {
+        return 1;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        time_t timer;
+        long nanos;
+        split_units(values[i], units_per_second, &timer, &nanos);
+
+        if (advance_tm(&tm, timer, nanos, output) || pack_fields(f->compiled, &tm, bcd, packed + i, output))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int dtf_parse_packed(const dtf_formatter_t *f, uint64_t packed, int bcd, parsed_t *parsed, char *output)
+{
+    // The integer is written back with all its digits and parsed, as the
+    // fields abut each one takes exactly its count of digits.
+    char text[20];
+    int digits;
+
+    if (packed_digits(f->compiled, bcd, &digits, output))
+    {
+        return -1;
+    }
+
+    for (int k = digits - 1; k >= 0; k--)
+    {
+        int digit = bcd ? (int)(packed & 0xf) : (int)(packed % 10);
+        if (digit > 9)
+        {
+            return 0;
+        }
+        text[k] = (char)('0' + digit);
+        packed = bcd ? packed >> 4 : packed / 10;
+    }
+
+    if (packed != 0)
+    {
+        return 0; // more digits than the pattern has.
+    }
+
+    int matched = dtf_parse(f->compiled, text, digits, f->locale, f->offset, f->timezone, f->local, parsed, output);
+
+    if (matched == 1 && parsed->length != (size_t)digits)
+    {
+        return 0;
+    }
+    return matched;
+}
+
+int zone_offset_at(const dtf_formatter_t *f, time_t timer)
+{
+    const zone_period_t *period;
+
+    if (f->local && (period = local_zone_period(timer)) != NULL)
+    {
+        return period->offset;
+    }
+    return f->offset;
+}
+
+int64_t bucket_of(resolution_t resolution, time_t local, long nanos)
+{
+    // Buckets are periods of local time, so that a bucket starts when the
+    // coarser fields change and every time in it renders the same text.
+    long year;
+    int month, day;
+
+    switch (resolution)
+    {
+    case RESOLUTION_MILLISECOND:
+        return (int64_t)local * 1000 + nanos / 1000000;
+    case RESOLUTION_SECOND:
+        return local;
+    case RESOLUTION_MINUTE:
+        return floorDiv(local, 60);
+    case RESOLUTION_HOUR:
+        return floorDiv(local, 3600);
+    case RESOLUTION_DAY:
+        return floorDiv(local, 86400);
+    case RESOLUTION_MONTH:
+        civil_from_days(floorDiv(local, 86400), &year, &month, &day);
+        return year * 12 + month - 1;
+    case RESOLUTION_YEAR:
+        civil_from_days(floorDiv(local, 86400), &year, &month, &day);
+        return year;
+    default:
+        return 0;
+    }
+}
+
+time_t bucket_start(resolution_t resolution, int64_t bucket, long *nanos)
+{
+    *nanos = 0;
+
+    switch (resolution)
+    {
+    case RESOLUTION_MILLISECOND:
+        *nanos = floorMod(bucket, 1000) * 1000000;
+        return floorDiv(bucket, 1000);
+    case RESOLUTION_SECOND:
+        return bucket;
+    case RESOLUTION_MINUTE:
+        return bucket * 60;
+    case RESOLUTION_HOUR:
+        return bucket * 3600;
+    case RESOLUTION_DAY:
+        return bucket * 86400;
+    case RESOLUTION_MONTH:
+        return days_from_civil(floorDiv(bucket, 12), (int)floorMod(bucket, 12) + 1, 1) * 86400;
+    case RESOLUTION_YEAR:
+        return days_from_civil(bucket, 1, 1) * 86400;
+    default:
+        return 0;
+    }
+}
+
+int dtf_bucketer_init(const dtf_formatter_t *f, dtf_bucketer_t *bucketer, char *output)
+{
+    dtf_pattern_info_t info;
+
+    if (dtf_pattern_info(f->compiled, &info, output))
+    {
+        return 1;
+    }
+
+    // The finest field must change exactly when its period of local time
+    // does, or times with the same text would fall in several buckets.
+    unsigned int hours = 1 << PATTERN_HOUR_OF_DAY1 | 1 << PATTERN_HOUR_OF_DAY0 | 1 << PATTERN_HOUR1 | 1 << PATTERN_HOUR0;
+    unsigned int days = 1 << PATTERN_DAY_OF_MONTH | 1 << PATTERN_DAY_OF_WEEK | 1 << PATTERN_DAY_OF_YEAR | 1 << PATTERN_ISO_DAY_OF_WEEK;
+
+    if (info.resolution == RESOLUTION_HOUR && !(info.fields & hours))
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Bucket keys need an hour field with the AM/PM marker.");
+        return 1;
+    }
+    if (info.resolution == RESOLUTION_DAY && !(info.fields & days))
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Bucket keys need a day field with weeks or the day of week in month.");
+        return 1;
+    }
+    if (info.resolution > RESOLUTION_DAY && (info.fields & 1 << PATTERN_WEEK_YEAR))
+    {
+        snprintf(output, ERROR_BUFFER_LENGTH, "Bucket keys need a day field with the week year.");
+        return 1;
+    }
+
+    bucketer->formatter = f;
+    bucketer->resolution = info.resolution;
+    // Local time repeats when clocks are set back, and only the zone name or
+    // offset tells the two passes apart.
+    bucketer->by_offset = f->local && info.zone_dependent;
+    return 0;
+}
+
+void dtf_bucket_key(const dtf_bucketer_t *bucketer, time_t timer, long nanos, int64_t *key)
+{
+    // Keys grow with time but where the local zone repeats or skips some of
+    // its time. Keys split by offset only tell buckets apart: "yyyy z" has
+    // the text "2023 EST" before and after the summer, under a single key.
+    const dtf_formatter_t *f = bucketer->formatter;
+    int offset = zone_offset_at(f, timer);
+
+    if (!bucketer->by_offset)
+    {
+        *key = bucket_of(bucketer->resolution, timer + offset, nanos);
+    }
+    else if (bucketer->resolution <= RESOLUTION_SECOND)
+    {
+        // Exact instants already tell the passes apart.
+        *key = bucket_of(bucketer->resolution, timer, nanos);
+    }
+    else
+    {
+        *key = bucket_of(bucketer->resolution, timer + offset, nanos) * (1 << BUCKET_OFFSET_BITS) +
+               (offset + (1 << (BUCKET_OFFSET_BITS - 1)));
+    }
+}
+
+void dtf_bucket_keys(const dtf_bucketer_t *bucketer, const int64_t *values, size_t n, long units_per_second, int64_t *keys)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        time_t timer;
+        long nanos;
+        split_units(values[i], units_per_second, &timer, &nanos);
+
+        dtf_bucket_key(bucketer, timer, nanos, &keys[i]);
+    }
+}
+
+int dtf_bucket_format(const dtf_bucketer_t *bucketer, int64_t key, strbuffer_t *toAppendTo, char *output)
+{
+    const dtf_formatter_t *f = bucketer->formatter;
+    time_t local, timer;
+    long nanos;
+
+    if (bucketer->by_offset && bucketer->resolution <= RESOLUTION_SECOND)
+    {
+        timer = bucket_start(bucketer->resolution, key, &nanos);
+    }
+    else if (bucketer->by_offset)
+    {
+        int offset = (int)floorMod(key, 1 << BUCKET_OFFSET_BITS) - (1 << (BUCKET_OFFSET_BITS - 1));
+        const zone_period_t *period;
+
+        local = bucket_start(bucketer->resolution, floorDiv(key, 1 << BUCKET_OFFSET_BITS), &nanos);
+        timer = local - offset;
+
+        // The start of the bucket may fall in the period before the one with
+        // this offset: the transition is then its first instant.
+        if ((period = local_zone_period(timer)) != NULL && period->offset != offset)
+        {
+            timer = period->end;
+        }
+    }
+    else
+    {
+        // With the local zone the offset depends on the instant itself, two
+        // rounds settle it but inside a gap, where any close instant will do.
+        local = bucket_start(bucketer->resolution, key, &nanos);
+        timer = local - zone_offset_at(f, local);
+        timer = local - zone_offset_at(f, timer);
+    }
+
+    return dtf_formatbn(f->compiled, timer, nanos, f->locale, f->offset, f->timezone, f->local, toAppendTo, output);
+}
+
+int check_column_field(int field, bool *civil, char *output)
+{
+    switch (field)
+    {
+    case ERA:
+    case YEAR:
+    case MONTH:
+    case DAY_OF_MONTH:
+    case DAY_OF_YEAR:
+    case ISO_WEEK_OF_YEAR:
+        *civil = true;
+        return 0;
+    case DAY_OF_WEEK:
+    case ISO_DAY_OF_WEEK:
+    case AM_PM:
+    case HOUR:
+    case HOUR_OF_DAY:
+    case MINUTE:
+    case SECOND:
+    case MILLISECOND:
+    case ZONE_OFFSET:
+    case DST_OFFSET:
+        return 0;
+    default:
+        snprintf(output, ERROR_BUFFER_LENGTH, "Calendar field %d can't be extracted to a column.", field);
+        return 1;
+    }
+}
+
+#define SPLIT_BLOCK(ups)                                                        \
+    for (size_t i = 0; i < rows; i++)                                           \
+    {                                                                           \
+        int64_t v = values[i];                                                  \
+        int64_t second = (v >= 0 ? v : v - (ups - 1)) / (ups);                  \
+        timers[i] = second;                                                     \
+        millis[i] = (int32_t)((v - second * (ups)) * 1000 / (ups));             \
+    }
 
-    case PATTERN_HOUR_OF_DAY1: // 'k' 1-based.  eg, 23:59 + 1 hour =>> 24:59
-        if (current == NULL)
+void split_block(const int64_t *values, size_t rows, long units_per_second, int64_t *timers, int32_t *millis)
+{
+    // As split_units to the millisecond, with the usual units spelled out
+    // so that the divisions are by constants and the loops vectorise.
+    switch (units_per_second)
+    {
+    case 1:
+        SPLIT_BLOCK(1L);
+        break;
+    case 1000:
+        SPLIT_BLOCK(1000L);
+        break;
+    case 1000000:
+        SPLIT_BLOCK(1000000L);
+        break;
+    case NANOS_PER_SECOND:
+        SPLIT_BLOCK(NANOS_PER_SECOND);
+        break;
+    default:
+        SPLIT_BLOCK(units_per_second);
+        break;
+    }
+}
+
+int dtf_calendar_fields(const int64_t *values, size_t n, long units_per_second, int offset, int local,
+                        const int *fields, int nfields, int32_t *const *columns, char *output)
+{
+    // Every column gets the value calendar_get has for its field, MONTH from
+    // 0 and DAY_OF_WEEK from Sunday 0 as in struct tm, but ISO_DAY_OF_WEEK
+    // is Monday 1 .. Sunday 7 and ISO_WEEK_OF_YEAR the week of ISO 8601,
+    // the one holding the Thursday of the year being 1. Rows go in blocks:
+    // the local day, time of day and zone are split out first, then every
+    // field is a loop of plain arithmetic over the block.
+    int64_t days[FIELDS_BLOCK_ROWS], years[FIELDS_BLOCK_ROWS];
+    int32_t seconds[FIELDS_BLOCK_ROWS], millis[FIELDS_BLOCK_ROWS], offsets[FIELDS_BLOCK_ROWS];
+    int32_t months[FIELDS_BLOCK_ROWS], mdays[FIELDS_BLOCK_ROWS];
+    int8_t dst[FIELDS_BLOCK_ROWS];
+    bool civil = false;
+
+    for (int k = 0; k < nfields; k++)
+    {
+        if (check_column_field(fields[k], &civil, output))
         {
-            // if (value == 0)
-            // {
-            //     zeroPaddingNumber(L, calendar_getMaximum(HOUR_OF_DAY) + 1, count, maxIntCount, buffer);
-            // }
-            // else
-            {
-                zeroPaddingNumber(L, value, count, maxIntCount, buffer);
-            }
+            return 1;
         }
-        break;
+    }
 
-    case PATTERN_DAY_OF_WEEK: // 'E'
-        // if (useDateFormatSymbols)
+    for (size_t begin = 0; begin < n; begin += FIELDS_BLOCK_ROWS)
+    {
+        size_t rows = n - begin < FIELDS_BLOCK_ROWS ? n - begin : FIELDS_BLOCK_ROWS;
+
+        split_block(values + begin, rows, units_per_second, days, millis);
+
+        for (size_t i = 0; i < rows; i++)
         {
-            if (count >= 4)
+            offsets[i] = offset;
+            dst[i] = 0;
+        }
+        for (size_t i = 0; local && i < rows; i++)
+        {
+            const zone_period_t *period = local_zone_period((time_t)days[i]);
+            if (period != NULL)
             {
-                // weekdays = formatData.getWeekdays();
-                // current = weekdays[value];
-                // calendar_getfield_at(L, date_table_index, "getWeekdays", value, &current);
-                strftime(strftime_buffer, STRFTIME_BUFFER_LENGTH, "%A", info);
-                current = strftime_buffer;
-            }
-            else
-            { // count < 4, use abbreviated form if exists
-                // weekdays = formatData.getShortWeekdays();
-                // current = weekdays[value];
-                // calendar_getfield_at(L, date_table_index, "getShortWeekdays", value, &current);
-                strftime(strftime_buffer, STRFTIME_BUFFER_LENGTH, "%a", info);
-                current = strftime_buffer;
+                offsets[i] = period->offset;
+                dst[i] = period->isdst > 0;
             }
         }
-        break;
 
-    case PATTERN_AM_PM: // 'a'
-        // if (useDateFormatSymbols)
+        // days holds the seconds until here.
+        for (size_t i = 0; i < rows; i++)
         {
-            // const char **ampm = formatData.getAmPmStrings();
-            // current = ampm[value];
-            // calendar_getfield_at(L, date_table_index, "getAmPmStrings", value, &current);
-            strftime(strftime_buffer, STRFTIME_BUFFER_LENGTH, "%p", info);
-            current = strftime_buffer;
+            int64_t t = days[i] + offsets[i];
+            int64_t day = (t >= 0 ? t : t - 86399) / 86400;
+            seconds[i] = (int32_t)(t - day * 86400);
+            days[i] = day;
         }
-        break;
 
-    case PATTERN_HOUR1: // 'h' 1-based.  eg, 11PM + 1 hour =>> 12 AM
-        if (current == NULL)
+        if (civil)
         {
-            // if (value == 0)
-            // {
-            //     zeroPaddingNumber(L, calendar_getLeastMaximum(HOUR) + 1, count, maxIntCount, buffer);
-            // }
-            // else
+            for (size_t i = 0; i < rows; i++)
             {
-                zeroPaddingNumber(L, value, count, maxIntCount, buffer);
+                long year;
+                int month, mday;
+                civil_from_days(days[i], &year, &month, &mday);
+                years[i] = year;
+                months[i] = month;
+                mdays[i] = mday;
             }
         }
-        break;
 
-    case PATTERN_ZONE_NAME: // 'z'
-        if (current == NULL)
+        for (int k = 0; k < nfields; k++)
         {
-            // if (formatData.locale == NULL || formatData.isZoneStringsSet)
-            // {
-            //     int zoneIndex =
-            //         formatData.getZoneIndex(calendar.getTimeZone().getID());
-            //     if (zoneIndex == -1)
-            //     {
-            //         value = calendar_get(L, date_table_index, ZONE_OFFSET) +
-            //                 calendar_get(L, date_table_index, DST_OFFSET);
-            //         buffer.append(ZoneInfoFile.toCustomID(value));
-            //     }
-            //     else
-            //     {
-            //         int index = (calendar_get(L, date_table_index, DST_OFFSET) == 0) ? 1 : 3;
-            //         if (count < 4)
-            //         {
-            //             // Use the short name
-            //             index++;
-            //         }
-            //         String[][] zoneStrings = formatData.getZoneStringsWrapper();
-            //         buffer.append(zoneStrings[zoneIndex][index]);
-            //     }
-            // }
-            // else
-            {
-                // TimeZone tz = calendar.getTimeZone();
-                // int tzstyle = (count < 4 ? TimeZone.SHORT_C : TimeZone.LONG_C);
-                // buffer.append(tz.getDisplayName(daylight, tzstyle, formatData.locale));
-                // bool daylight = (calendar_get(L, date_table_index, DST_OFFSET) != 0);
-
-                // char *s;
-                // if (count >= 4)
-                // {
-                //     calendar_getfield_at(L, date_table_index, "getTimeZone", 1, &s);
-                // }
-                // else
-                // {
-                //     calendar_getfield_at(L, date_table_index, "getShortTimeZone", 1, &s);
-                // }
+            int32_t *column = columns[k] + begin;
 
-                if (tm.localtime)
-                {
-                    strftime(strftime_buffer, STRFTIME_BUFFER_LENGTH, "%Z", info);
-                    luaL_addstring(buffer, strftime_buffer);
-                }
-                else
+            switch (fields[k])
+            {
+            case ERA:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = years[i] >= 0;
+                break;
+            case YEAR:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = (int32_t)years[i];
+                break;
+            case MONTH:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = months[i] - 1;
+                break;
+            case DAY_OF_MONTH:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = mdays[i];
+                break;
+            case DAY_OF_YEAR:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = (int32_t)(days[i] - days_from_civil(years[i], 1, 1)) + 1;
+                break;
+            case ISO_WEEK_OF_YEAR:
+                for (size_t i = 0; i < rows; i++)
                 {
-                    luaL_addstring(buffer, tm.zone_name);
+                    // The week belongs to the year of its Thursday, three days
+                    // after or before the date at most.
+                    int64_t thursday = days[i] - floorMod(days[i] + 3, 7) + 3;
+                    int64_t year = years[i] + (months[i] == 12 && thursday - days[i] > 31 - mdays[i]) -
+                                   (months[i] == 1 && days[i] - thursday >= mdays[i]);
+                    column[i] = (int32_t)((thursday - days_from_civil(year, 1, 1)) / 7) + 1;
                 }
+                break;
+            case DAY_OF_WEEK:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = (int32_t)floorMod(days[i] + 4, 7);
+                break;
+            case ISO_DAY_OF_WEEK:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = (int32_t)floorMod(days[i] + 3, 7) + 1;
+                break;
+            case AM_PM:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = seconds[i] >= 12 * 3600;
+                break;
+            case HOUR:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = seconds[i] / 3600 % 12;
+                break;
+            case HOUR_OF_DAY:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = seconds[i] / 3600;
+                break;
+            case MINUTE:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = seconds[i] / 60 % 60;
+                break;
+            case SECOND:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = seconds[i] % 60;
+                break;
+            case MILLISECOND:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = millis[i];
+                break;
+            case ZONE_OFFSET:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = offsets[i];
+                break;
+            case DST_OFFSET:
+                for (size_t i = 0; i < rows; i++)
+                    column[i] = dst[i];
+                break;
             }
         }
-        break;
-
-    case PATTERN_ZONE_VALUE: // 'Z' ("-/+hhmm" form)
-        // value = (calendar_get(L, info, ZONE_OFFSET) + calendar_get(L, info, DST_OFFSET)) / 60000;
-
-        // int width = 4;
-        // if (value >= 0)
-        // {
-        //     add_char(buffer, '+');
-        // }
-        // else
-        // {
-        //     width++;
-        // }
+    }
 
-        // int num = (value / 60) * 100 + (value % 60);
-        // sprintf0d(buffer, num, width);
+    return 0;
+}
 
-        strftime(strftime_buffer, STRFTIME_BUFFER_LENGTH, "%z", info);
-        luaL_addstring(buffer, strftime_buffer);
+#ifdef CLOCK_REALTIME_COARSE
+#define CLOCK_COARSE CLOCK_REALTIME_COARSE
+#else
+#define CLOCK_COARSE CLOCK_REALTIME
+#endif
 
-        break;
+struct dtf_clock_s
+{
+    dtf_formatter_t formatter;
+    int flags;
+    _Atomic unsigned sequence; // seqlock, odd while the slot is being written.
+    _Atomic long second;       // the second rendered in text, it only moves forward.
+    clockid_t source;          // the one clock of the ticker and readers.
+    long lag;                  // nanoseconds the source may lag behind, the ticker wakes that late.
+    char text[CLOCK_TEXT_LENGTH];
+    size_t length;
+    int nsubsecond; // the 'SSS' fields, -1 if some can't be spliced in place.
+    int subsecond_at[CLOCK_SUBSECOND_FIELDS];
+    pthread_mutex_t mutex; // one writer at a time.
+    pthread_t ticker;
+    pthread_mutex_t ticker_mutex;
+    pthread_cond_t ticker_cond;
+    int ticking;
+    int stop;
+};
 
-    case PATTERN_ISO_ZONE: // 'X'
+int clock_render(dtf_clock_t *clock, time_t second, char *output)
+{
+    // Renders the given second token by token, so that the place of the
+    // milliseconds digits is known and they can be spliced in by readers.
+    const dtf_formatter_t *f = &clock->formatter;
+    buffer_t *compiledPattern = f->compiled;
+    strbuffer_t b;
+    tm_t tm;
+    int tag, count, nsubsecond = 0;
+    int subsecond_at[CLOCK_SUBSECOND_FIELDS];
 
-        failed = calendar_get(L, tm, ZONE_OFFSET, &zone_o, output);
-        if (failed)
-            return failed;
+    if (init_tm(&tm, second, 0, f->locale, f->offset, f->timezone, f->local, output))
+    {
+        return 1;
+    }
 
-        failed = calendar_get(L, tm, DST_OFFSET, &dst_o, output);
-        if (failed)
-            return failed;
+    init_strbuffer(&b);
 
-        value = zone_o + dst_o;
+    for (int i = 0; i < compiledPattern->length;)
+    {
+        int j = next_tag(compiledPattern, i, &tag, &count);
 
-        if (value == 0)
+        if (tag == TAG_QUOTE_CHARS)
         {
-            luaL_addchar(buffer, 'Z');
-            break;
+            j += QUOTE_CELLS(count);
         }
-
-        value /= 60000;
-        if (value >= 0)
+        else if (tag == TAG_DAY_SEGMENT)
         {
-            luaL_addchar(buffer, '+');
+            j += count;
         }
-        else
+        else if (tag == TAG_KERNEL)
         {
-            luaL_addchar(buffer, '-');
-            value = -value;
+            i = j; // token by token, the generic code is used.
+            continue;
         }
-
-        sprintf0d(buffer, value / 60, 2);
-        if (count == 1)
+        else if (tag == PATTERN_MILLISECOND)
         {
-            break;
+            if (count < 3 || nsubsecond == CLOCK_SUBSECOND_FIELDS)
+            {
+                // Variable width milliseconds, they can't be spliced in place.
+                nsubsecond = -1;
+            }
+            else if (nsubsecond >= 0)
+            {
+                subsecond_at[nsubsecond++] = (int)b.length + count - 3;
+            }
         }
 
-        if (count == 3)
+        if (j < compiledPattern->length)
         {
-            luaL_addchar(buffer, ':');
+            int pad, pad_count;
+            int k = next_tag(compiledPattern, j, &pad, &pad_count);
+            if (pad == TAG_PAD)
+            {
+                j = k; // a padding is rendered with its field.
+            }
         }
-        sprintf0d(buffer, value % 60, 2);
-        break;
 
-    default:
-        // case PATTERN_DAY_OF_MONTH:         // 'd'
-        // case PATTERN_HOUR_OF_DAY0:         // 'H' 0-based.  eg, 23:59 + 1 hour =>> 00:59
-        // case PATTERN_MINUTE:               // 'm'
-        // case PATTERN_SECOND:               // 's'
-        // case PATTERN_MILLISECOND:          // 'S'
-        // case PATTERN_DAY_OF_YEAR:          // 'D'
-        // case PATTERN_DAY_OF_WEEK_IN_MONTH: // 'F'
-        // case PATTERN_WEEK_OF_YEAR:         // 'w'
-        // case PATTERN_WEEK_OF_MONTH:        // 'W'
-        // case PATTERN_HOUR0:                // 'K' eg, 11PM + 1 hour =>> 0 AM
-        // case PATTERN_ISO_DAY_OF_WEEK:      // 'u' pseudo field, Monday = 1, ..., Sunday = 7
-        if (current == NULL)
+        if (format_range(compiledPattern, i, j, &tm, &b, output))
         {
-            zeroPaddingNumber(L, value, count, maxIntCount, buffer);
+            free_strbuffer(&b);
+            return 1;
         }
-        break;
-    } // switch (patternCharIndex)
 
-    if (current != NULL)
+        i = j;
+    }
+
+    if (b.length >= CLOCK_TEXT_LENGTH)
     {
-        luaL_addstring(buffer, current);
+        snprintf(output, ERROR_BUFFER_LENGTH, "The clock pattern renders %zu bytes, more than %d.", b.length, CLOCK_TEXT_LENGTH - 1);
+        free_strbuffer(&b);
+        return 1;
     }
 
-    // int fieldID = PATTERN_INDEX_TO_DATE_FORMAT_FIELD[patternCharIndex];
-    // field_t f = PATTERN_INDEX_TO_DATE_FORMAT_FIELD_ID[patternCharIndex];
+    // Write side of the seqlock: odd while the slot is being changed.
+    unsigned sequence = atomic_load_explicit(&clock->sequence, memory_order_relaxed);
+    atomic_store_explicit(&clock->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
 
-    // formatted(fieldID, f, f, beginOffset, luaL_bufflen(buffer), buffer);
-    return failed;
+    memcpy(clock->text, b.buffer, b.length);
+    clock->length = b.length;
+    clock->nsubsecond = nsubsecond;
+    for (int k = 0; k < nsubsecond; k++)
+    {
+        clock->subsecond_at[k] = subsecond_at[k];
+    }
+    atomic_store_explicit(&clock->second, (long)second, memory_order_relaxed);
+
+    atomic_store_explicit(&clock->sequence, sequence + 2, memory_order_release);
+
+    free_strbuffer(&b);
+    return 0;
 }
 
-int dtf_format(buffer_t *compiledPattern, time_t timer, const char *locale, int offset, const char *timezone, int local, char *output)
+int clock_refresh(dtf_clock_t *clock, time_t second, char *output)
 {
     int failed = 0;
-    char_t *shifted;
 
-    if (setlocale(LC_TIME, locale) == NULL)
+    // A late caller never writes an older second back over the slot.
+    pthread_mutex_lock(&clock->mutex);
+    if (atomic_load_explicit(&clock->second, memory_order_relaxed) < (long)second)
+    {
+        failed = clock_render(clock, second, output);
+    }
+    pthread_mutex_unlock(&clock->mutex);
+
+    return failed;
+}
+
+void *clock_ticker(void *arg)
+{
+    dtf_clock_t *clock = (dtf_clock_t *)arg;
+    char error[ERROR_BUFFER_LENGTH];
+    struct timespec now;
+
+    pthread_mutex_lock(&clock->ticker_mutex);
+    while (!clock->stop)
+    {
+        clock_gettime(clock->source, &now);
+        pthread_mutex_unlock(&clock->ticker_mutex);
+
+        clock_refresh(clock, now.tv_sec, error);
+
+        pthread_mutex_lock(&clock->ticker_mutex);
+
+        // Wake up at the beginning of the next second, once the source shows it.
+        struct timespec next = {now.tv_sec + 1, clock->lag};
+        while (!clock->stop && pthread_cond_timedwait(&clock->ticker_cond, &clock->ticker_mutex, &next) == 0)
+            ;
+    }
+    pthread_mutex_unlock(&clock->ticker_mutex);
+
+    return NULL;
+}
+
+int dtf_clock_init(const dtf_formatter_t *formatter, int flags, dtf_clock_t **clockRef, char *output)
+{
+    struct timespec now;
+    struct timespec resolution;
+    dtf_clock_t *clock = (dtf_clock_t *)calloc(1, sizeof(dtf_clock_t));
+
+    if (clock == NULL)
     {
-        sprintf(output, "Impossible to set the \"%s\" locale.", locale);
+        snprintf(output, ERROR_BUFFER_LENGTH, "Out of memory for the clock.");
         return 1;
     }
 
-    tm_t tm; //  allocate the main structure to hold all the data.
+    clock->formatter = *formatter;
+    clock->flags = flags;
+    // The milliseconds need the precise clock, the second alone the coarse one.
+    clock->source = (flags & DTF_CLOCK_SUBSECOND) ? CLOCK_REALTIME : CLOCK_COARSE;
+    clock->lag = clock_getres(clock->source, &resolution) == 0 && resolution.tv_sec == 0 ? resolution.tv_nsec : 0;
+    atomic_init(&clock->sequence, 0);
+    atomic_init(&clock->second, LONG_MIN);
+    pthread_mutex_init(&clock->mutex, NULL);
+    pthread_mutex_init(&clock->ticker_mutex, NULL);
+    pthread_cond_init(&clock->ticker_cond, NULL);
 
-    tm.zone_name = timezone;
-    tm.zone_offset = offset;
-    tm.localtime = local;
+    clock_gettime(clock->source, &now);
+    if (clock_render(clock, now.tv_sec, output))
+    {
+        dtf_clock_destroy(clock);
+        return 1;
+    }
 
-    if (local)
+    if ((flags & DTF_CLOCK_TICKER) && pthread_create(&clock->ticker, NULL, clock_ticker, clock) == 0)
     {
-        tm.tm = localtime(&timer);
+        clock->ticking = 1;
     }
-    else
+
+    *clockRef = clock;
+    return 0;
+}
+
+void dtf_clock_destroy(dtf_clock_t *clock)
+{
+    if (clock->ticking)
     {
-        timer += offset;
-        tm.tm = gmtime(&timer);
+        pthread_mutex_lock(&clock->ticker_mutex);
+        clock->stop = 1;
+        pthread_cond_signal(&clock->ticker_cond);
+        pthread_mutex_unlock(&clock->ticker_mutex);
+
+        pthread_join(clock->ticker, NULL);
+        clock->ticking = 0;
     }
 
-    lua_State *L = luaL_newstate();
-    luaL_Buffer toAppendTo;
-    luaL_buffinit(L, &toAppendTo);
+    pthread_mutex_destroy(&clock->mutex);
+    pthread_mutex_destroy(&clock->ticker_mutex);
+    pthread_cond_destroy(&clock->ticker_cond);
+    free(clock);
+}
+
+size_t dtf_clock_now(dtf_clock_t *clock, char *out)
+{
+    struct timespec now;
+    char error[ERROR_BUFFER_LENGTH];
+    int subsecond = clock->flags & DTF_CLOCK_SUBSECOND;
+
+    clock_gettime(clock->source, &now);
 
-    for (int i = 0; i < compiledPattern->length;)
+    if (subsecond && clock->nsubsecond < 0)
     {
-        int tag = triple_shift(compiledPattern->buffer[i], 8);
-        int count = compiledPattern->buffer[i++] & 0xff;
-        if (count == 255)
+        // The milliseconds can't be spliced, the pattern is rendered in full.
+        const dtf_formatter_t *f = &clock->formatter;
+        strbuffer_t b;
+        init_strbuffer(&b);
+
+        size_t length = 0;
+        if (!dtf_formatbn(f->compiled, now.tv_sec, now.tv_nsec, f->locale, f->offset, f->timezone, f->local, &b, error) &&
+            b.length < CLOCK_TEXT_LENGTH)
         {
-            count = compiledPattern->buffer[i++] << 16;
-            count |= compiledPattern->buffer[i++];
+            length = b.length;
+            memcpy(out, b.buffer, length);
         }
+        out[length] = '\0';
 
-        switch (tag)
-        {
-        case TAG_QUOTE_ASCII_CHAR:
-            luaL_addchar(&toAppendTo, (char)count);
-            break;
+        free_strbuffer(&b);
+        return length;
+    }
 
-        case TAG_QUOTE_CHARS:
-            // luaL_addlstring(&toAppendTo, (char *)(compiledPattern->buffer + i), count);
-            shifted = compiledPattern->buffer + i;
-            for (int j = 0; j < count; j++)
+    for (;;)
+    {
+        // Read side of the seqlock: retry if a writer was in the middle of it.
+        unsigned before = atomic_load_explicit(&clock->sequence, memory_order_acquire);
+        long second = atomic_load_explicit(&clock->second, memory_order_relaxed);
+
+        if (second < (long)now.tv_sec)
+        {
+            if (clock_refresh(clock, now.tv_sec, error))
             {
-                luaL_addchar(&toAppendTo, (char)shifted[j]);
+                out[0] = '\0';
+                return 0; // the pattern rendered once at init, so it fails only out of memory.
             }
-            i += count;
-            break;
+            continue;
+        }
 
-        default:
-            failed = subFormat(L, tm, tag, count, &toAppendTo, output);
-            if (failed)
-                return failed;
-            else
-                break;
+        if (second > (long)now.tv_sec && subsecond)
+        {
+            // Published after this reader read the time: the milliseconds
+            // would belong to the second before, they are read again.
+            clock_gettime(clock->source, &now);
+            continue;
+        }
+
+        if (before & 1)
+        {
+            continue;
         }
-    }
 
-    luaL_pushresult(&toAppendTo);
-    strcpy(output, lua_tostring(L, -1));
-    lua_close(L);
+        size_t length = clock->length;
+        int nsubsecond = clock->nsubsecond;
+        int subsecond_at[CLOCK_SUBSECOND_FIELDS];
 
-    return failed;
+        memcpy(out, clock->text, length < CLOCK_TEXT_LENGTH ? length : CLOCK_TEXT_LENGTH - 1);
+        for (int k = 0; k < nsubsecond && k < CLOCK_SUBSECOND_FIELDS; k++)
+        {
+            subsecond_at[k] = clock->subsecond_at[k];
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&clock->sequence, memory_order_relaxed) != before)
+        {
+            continue;
+        }
+
+        if (subsecond && nsubsecond > 0)
+        {
+            int millis = (int)(now.tv_nsec / 1000000);
+            for (int k = 0; k < nsubsecond; k++)
+            {
+                out[subsecond_at[k]] = (char)('0' + millis / 100);
+                out[subsecond_at[k] + 1] = (char)('0' + millis / 10 % 10);
+                out[subsecond_at[k] + 2] = (char)('0' + millis % 10);
+            }
+        }
+
+        out[length] = '\0';
+        return length;
+    }
 }
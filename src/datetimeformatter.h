@@ -8,14 +8,38 @@
 #include <time.h>
 #include <math.h>
 #include <locale.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
 
 #define STRFTIME_BUFFER_LENGTH 128
+#define STRBUFFER_INIT_SIZE 256
+#define ERROR_BUFFER_LENGTH 1024
 
 #define Long_MAX_VALUE 0x7fffffffffffffffL
 #define NANOS_PER_SECOND 1000000000L
 
 #define TAG_QUOTE_ASCII_CHAR 100
 #define TAG_QUOTE_CHARS 101
+#define TAG_DAY_SEGMENT 102
+#define TAG_PAD 103    // the field before is padded with spaces, or cut, to count bytes.
+#define TAG_KERNEL 104 // first, its count is the KERNEL_* of the pattern.
+
+#define KERNEL_ISO_SECONDS 1
+#define KERNEL_ISO_MILLIS 2
+#define KERNEL_ISO_SECONDS_ZONE 3
+#define KERNEL_ISO_MILLIS_ZONE 4
+#define KERNEL_RFC1123 5
+#define KERNEL_COMMON_LOG 6
+#define KERNEL_SYSLOG 7
+#define KERNEL_COUNT 8
+
+// Cells taken by the payload of a TAG_QUOTE_CHARS, whose count is in bytes.
+#define QUOTE_CELLS(count) (((count) + 1) / 2)
 
 #define PATTERN_ERA 0
 #define PATTERN_YEAR 1
@@ -43,19 +67,117 @@
 
 #define WEEK_YEAR FIELD_COUNT
 #define ISO_DAY_OF_WEEK 1000
+#define ISO_WEEK_OF_YEAR 1001 // only for dtf_calendar_fields.
+
+#define NAME_LENGTH 64
+
+typedef struct name_s
+{
+    unsigned char length;
+    char text[NAME_LENGTH]; // raw bytes, UTF-8 for non-Latin locales.
+} name_t;
+
+#define LOCALE_ID_LENGTH 64
+
+// Only chars, so that the records of a snapshot file can be used in place.
+typedef struct locale_names_s
+{
+    char locale[LOCALE_ID_LENGTH];
+    name_t months[12];
+    name_t short_months[12];
+    name_t weekdays[7];
+    name_t short_weekdays[7];
+    name_t ampm[2];
+    name_t eras[2];
+} locale_names_t;
+
+typedef struct locale_entry_s
+{
+    const locale_names_t *names;
+    struct locale_entry_s *next;
+} locale_entry_t;
 
-static const char *patternChars = "GyMdkHmsSEDFwWahKzZYuXL";
+#define LOCALE_SNAPSHOT_MAGIC "DTFLOCAL"
+#define LOCALE_SNAPSHOT_VERSION 1
+
+typedef struct locale_snapshot_header_s
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size; // sizeof(locale_names_t) of the generator.
+    uint32_t count;
+    uint32_t reserved;
+} locale_snapshot_header_t;
+
+typedef struct locale_snapshot_s
+{
+    void *base;
+    size_t size;
+    struct locale_snapshot_s *next;
+} locale_snapshot_t;
 
 typedef struct tm_s
 {
-    struct tm *tm;
+    time_t timer;     // local seconds, that is UTC seconds plus zone_offset.
+    long day;         // local days since the epoch.
+    long year;        // civil date of the local day,
+    int month;        // 1..12,
+    int mday;         // computed on demand:
+    int civil;        // whether year, month and mday are set for day.
+    int seconds;      // seconds within the local day.
+    int nanos;        // nanoseconds within the second.
     int zone_offset;
     const char *zone_name;
+    int isdst;        // -1 but with the local zone.
+    const locale_names_t *names;
     int localtime;
 } tm_t;
 
+#define ZONE_NAME_LENGTH 64
+#define ZONE_STRINGS_CACHE_SIZE 8
+#define FIXED_ZONE_NAME_WIDTH 6 // the zone abbreviations of the tz database fit.
+#define ZONE_PERIOD_PROBE 86400 // no two transitions of the local zone are closer.
+
+// A period of the local zone with the same offset and abbreviation.
+typedef struct zone_period_s
+{
+    time_t start; // UTC seconds, inclusive.
+    time_t end;   // UTC seconds, exclusive.
+    int offset;
+    int isdst;
+    char name[ZONE_NAME_LENGTH];
+} zone_period_t;
+
+typedef struct zone_strings_s
+{
+    int offset; // seconds east of UTC.
+    int isdst;
+    int localtime;
+    char rfc822[5];        // "+hhmm"
+    char iso8601[3][6];    // "+hh", "+hhmm", "+hh:mm" or "Z"
+    int iso8601_length[3];
+    const char *name;
+    size_t name_length;
+    char name_init[ZONE_NAME_LENGTH];
+} zone_strings_t;
+
 typedef unsigned short char_t;
 
+#define DAY_SEGMENTS_CACHE_SIZE 64 // a power of two.
+#define DAY_SEGMENT_CELLS 32
+#define DAY_SEGMENT_LENGTH 96
+
+typedef struct day_segment_s
+{
+    const char_t *cells; // where the segment lives in its compiled pattern.
+    int ncells;
+    char_t code[DAY_SEGMENT_CELLS];
+    long day;
+    const locale_names_t *names;
+    char rendered[DAY_SEGMENT_LENGTH];
+    size_t length;
+} day_segment_t;
+
 typedef enum Calendar
 {
 
@@ -618,6 +740,14 @@ typedef struct buffer_s
     char_t *buffer;
 } buffer_t;
 
+typedef struct strbuffer_s
+{
+    size_t size;
+    size_t length;
+    char *buffer;
+    char init[STRBUFFER_INIT_SIZE];
+} strbuffer_t;
+
 typedef enum DateFormat
 {
     /**
@@ -720,10 +850,220 @@ typedef enum DateFormat
     TIMEZONE_FIELD = 17,
 } dateformat_t;
 
+typedef struct fields_s
+{
+    long year;
+    int month;       // 1..12
+    int day;         // 1..31
+    int day_of_year; // 1..366, zero if not set.
+    int hour;
+    bool hour12;     // hour is on the 12-hour clock, ampm tells the half.
+    int ampm;
+    int minute;
+    int second;
+    long nanos;
+    int zone_offset;
+    bool has_zone;
+    bool ambiguous_year; // two digits, the century is implied.
+} fields_t;
+
+// Why a pattern didn't compile; nothing is formatted until dtf_status_message.
+typedef enum dtf_error
+{
+    DTF_OK = 0,
+    DTF_ERROR_ILLEGAL_CHARACTER,    // detail is the character.
+    DTF_ERROR_UNTERMINATED_QUOTE,
+    DTF_ERROR_ISO_ZONE_LENGTH,      // detail is the count of 'X'.
+    DTF_ERROR_STRFTIME_CONVERSION,  // detail is the conversion character.
+    DTF_ERROR_STRFTIME_LONE_PERCENT,
+} dtf_error_t;
+
+typedef struct dtf_status_s
+{
+    dtf_error_t code;
+    int position; // of the offending character in the pattern.
+    int detail;
+} dtf_status_t;
+
+typedef struct parsed_s
+{
+    time_t timer;    // UTC seconds since the epoch.
+    long nanos;      // nanoseconds within the second.
+    int zone_offset; // seconds east of UTC the text was written in.
+    size_t length;   // bytes of the text matched by the pattern.
+} parsed_t;
+
+typedef struct dtf_formatter_s
+{
+    buffer_t *compiled;
+    const char *locale;
+    int offset;
+    const char *timezone;
+    int local;
+} dtf_formatter_t;
+
+// A step of the patterns of a matcher: a field, one literal byte or a pad.
+typedef struct matcher_node_s
+{
+    int tag;        // a PATTERN_*, TAG_QUOTE_ASCII_CHAR or TAG_PAD.
+    int count;      // the count of the field or pad, the byte of a literal.
+    bool abutting;  // a numeric field follows, as in "yyyyMMdd".
+    int pattern;    // the pattern ending with this step, -1 if none.
+    int first;      // the lowest pattern through this step.
+    int child;      // children by increasing first, -1 if none.
+    int sibling;
+} matcher_node_t;
+
+// Patterns compiled in a trie over their steps, node 0 is the root.
+typedef struct dtf_matcher_s
+{
+    size_t size;
+    size_t length;
+    matcher_node_t *nodes;
+    int npatterns;
+} dtf_matcher_t;
+
+#define PARSE_PLAN_WIDTH 64
+#define PARSE_PLAN_FIELDS 16
+
+typedef struct parse_plan_field_s
+{
+    int tag;
+    int count; // the digits of the field.
+    size_t at; // where the digits begin in the text.
+} parse_plan_field_t;
+
+// The one shape of the texts of a pattern made of numeric fields and
+// literals only, as in "yyyy-MM-dd HH:mm:ss".
+typedef struct parse_plan_s
+{
+    size_t width; // 0 when the pattern has no such shape.
+    unsigned char lo[PARSE_PLAN_WIDTH], hi[PARSE_PLAN_WIDTH]; // the bytes allowed at every position.
+    int nfields;
+    parse_plan_field_t fields[PARSE_PLAN_FIELDS];
+} parse_plan_t;
+
+// From the finest to the coarsest, the period after which the output may change.
+typedef enum Resolution
+{
+    RESOLUTION_MILLISECOND,
+    RESOLUTION_SECOND,
+    RESOLUTION_MINUTE,
+    RESOLUTION_HOUR,
+    RESOLUTION_DAY,
+    RESOLUTION_MONTH,
+    RESOLUTION_YEAR,
+    RESOLUTION_NONE, // only literals and zone fields.
+} resolution_t;
+
+typedef struct dtf_pattern_info_s
+{
+    unsigned int fields; // 1 << PATTERN_* for every pattern letter used.
+    bool fixed_width;    // every output has the same length in bytes.
+    size_t min_length;   // in bytes, years taken in [1, 9999].
+    size_t max_length;
+    bool locale_dependent; // prints month, weekday, AM/PM or era names.
+    bool zone_dependent;   // prints the zone name or offset.
+    resolution_t resolution;
+} dtf_pattern_info_t;
+
+// The resolution of a pattern, prepared once for its bucket keys.
+typedef struct dtf_bucketer_s
+{
+    const dtf_formatter_t *formatter;
+    resolution_t resolution;
+    bool by_offset; // the local zone and a printed zone: the offset is in the key, keys are not ordered.
+} dtf_bucketer_t;
+
+#define BUCKET_OFFSET_BITS 18 // offsets of the local zone are within 2^17 seconds.
+
+#define FORMAT_MANY_CALENDARS 8
+// Encodings of dtf_format_column, varints are LEB128 and signed ones zigzag.
+#define DTF_COLUMN_DELTA 0          // the first value then the deltas, signed varints.
+#define DTF_COLUMN_DELTA_OF_DELTA 1 // the first value, the first delta then the changes of delta.
+#define DTF_COLUMN_FOR 2            // blocks: signed base, count, a bit width byte then the packed offsets.
+#define DTF_COLUMN_MAX_BLOCK_ROWS 65536 // the count of a DTF_COLUMN_FOR block, bounds zero-width blocks.
+
+#define BATCH_BLOCK_ROWS 16384 // a multiple of 8, so that blocks own whole bytes of a validity bitmap.
+#define FIELDS_BLOCK_ROWS 1024
+#define POOL_MAX_THREADS 256
+
+#define CLOCK_TEXT_LENGTH 128
+#define CLOCK_SUBSECOND_FIELDS 4
+
+#define DTF_CLOCK_TICKER 1    // a thread renders every second as it begins.
+#define DTF_CLOCK_SUBSECOND 2 // read the precise clock and splice the milliseconds in.
+
+// A clock rendering the current second once for all its readers, opaque
+// to callers.
+typedef struct dtf_clock_s dtf_clock_t;
+
+// A task is run once for every index in [0, ntasks); an executor runs
+// them concurrently and returns once all of them have completed.
+typedef void (*dtf_task_t)(void *, int);
+typedef void (*dtf_executor_t)(dtf_task_t, void *, int, void *);
+
 buffer_t *new_buffer(size_t);
 void free_buffer(buffer_t *);
 void add_char(buffer_t *, char_t);
 void add_buffer(buffer_t *, buffer_t *);
+void add_bytes(buffer_t *, const char *, size_t);
+
+void init_strbuffer(strbuffer_t *);
+void free_strbuffer(strbuffer_t *);
+char *reserve_strbuffer(strbuffer_t *, size_t);
+void add_strchar(strbuffer_t *, char);
+void add_lstring(strbuffer_t *, const char *, size_t);
+void add_string(strbuffer_t *, const char *);
+void add_integer(strbuffer_t *, long, int);
 
 int dtf_compile(const char *, buffer_t **, char *);
-int dtf_format(buffer_t *, time_t, const char *, int, const char *, int, char *);
\ No newline at end of file
+int dtf_compile_status(const char *, buffer_t **, dtf_status_t *);
+int dtf_compile_strftime_status(const char *, buffer_t **, dtf_status_t *);
+size_t dtf_status_message(const dtf_status_t *, char *, size_t);
+int dtf_compile_fixed(const char *, const char *, buffer_t **, char *);
+int dtf_compile_strftime(const char *, buffer_t **, char *);
+int dtf_pattern_info(buffer_t *, dtf_pattern_info_t *, char *);
+int dtf_format(buffer_t *, time_t, const char *, int, const char *, int, char *);
+int dtf_format_many(const dtf_formatter_t *, int, time_t, long, strbuffer_t *, int64_t *, char *);
+int dtf_formatb(buffer_t *, time_t, const char *, int, const char *, int, strbuffer_t *, char *);
+int dtf_formatbn(buffer_t *, time_t, long, const char *, int, const char *, int, strbuffer_t *, char *);
+int dtf_parse(buffer_t *, const char *, size_t, const char *, int, const char *, int, parsed_t *, char *);
+time_t dtf_timegm(const struct tm *);
+time_t dtf_mktime(const struct tm *, int, int, int *);
+void dtf_mktime_batch(const struct tm *, size_t, int, int, time_t *, int *);
+void dtf_zone_reset(void); // to be called after TZ is changed.
+int dtf_matcher_compile(const char **, int, dtf_matcher_t **, char *);
+void dtf_matcher_free(dtf_matcher_t *);
+int dtf_matcher_parse(const dtf_matcher_t *, const char *, size_t, const char *, int, const char *, int, int *, parsed_t *, char *);
+
+void dtf_pool_executor(dtf_task_t, void *, int, void *);
+int dtf_format_batch(const dtf_formatter_t *, const int64_t *, size_t, long, strbuffer_t *, int64_t *, char *);
+int dtf_format_batch_parallel(const dtf_formatter_t *, const int64_t *, size_t, long, int, dtf_executor_t, void *, strbuffer_t *, int64_t *, char *);
+int dtf_parse_batch(const dtf_formatter_t *, const char *, const int64_t *, size_t, long, int64_t *, uint8_t *, char *);
+int dtf_parse_batch_parallel(const dtf_formatter_t *, const char *, const int64_t *, size_t, long, int, dtf_executor_t, void *, int64_t *, uint8_t *, char *);
+int dtf_seek(const dtf_formatter_t *, const char *, size_t, size_t, size_t, time_t, time_t, size_t *, size_t *, char *);
+
+int dtf_format_column(const dtf_formatter_t *, int, const unsigned char *, size_t, long, char, strbuffer_t *, size_t *, char *);
+int dtf_format_fixed(const dtf_formatter_t *, const int64_t *, size_t, long, char *, size_t *, char *);
+int dtf_parse_fixed(const dtf_formatter_t *, const char *, size_t, size_t, parsed_t *, char *);
+int dtf_format_packed(const dtf_formatter_t *, time_t, long, int, uint64_t *, char *);
+int dtf_format_packed_batch(const dtf_formatter_t *, const int64_t *, size_t, long, int, uint64_t *, char *);
+int dtf_parse_packed(const dtf_formatter_t *, uint64_t, int, parsed_t *, char *);
+int dtf_bucketer_init(const dtf_formatter_t *, dtf_bucketer_t *, char *);
+void dtf_bucket_key(const dtf_bucketer_t *, time_t, long, int64_t *);
+void dtf_bucket_keys(const dtf_bucketer_t *, const int64_t *, size_t, long, int64_t *);
+int dtf_bucket_format(const dtf_bucketer_t *, int64_t, strbuffer_t *, char *);
+int dtf_calendar_fields(const int64_t *, size_t, long, int, int, const int *, int, int32_t *const *, char *);
+
+int dtf_clock_init(const dtf_formatter_t *, int, dtf_clock_t **, char *);
+void dtf_clock_destroy(dtf_clock_t *);
+size_t dtf_clock_now(dtf_clock_t *, char *);
+
+int dtf_locales_dump(const char *, const char **, int, char *);
+int dtf_locales_load(const char *, char *);
+void dtf_locales_prewarm(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <locale.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "datetimeformatter.h"
+
+#define PATTERN_METATABLE "datetimeformatter.pattern"
+#define DATE_CACHE_SIZE 256 // formats cached by date before the cache is emptied.
+
+typedef struct pattern_ud_s
+{
+    buffer_t *compiled;
+} pattern_ud_t;
+
+static buffer_t *check_pattern(lua_State *L, int arg)
+{
+    pattern_ud_t *ud = (pattern_ud_t *)luaL_checkudata(L, arg, PATTERN_METATABLE);
+    luaL_argcheck(L, ud->compiled != NULL, arg, "compiled pattern already released");
+    return ud->compiled;
+}
+
+static int l_pattern_gc(lua_State *L)
+{
+    pattern_ud_t *ud = (pattern_ud_t *)luaL_checkudata(L, 1, PATTERN_METATABLE);
+    free_buffer(ud->compiled);
+    ud->compiled = NULL;
+    return 0;
+}
+
+static int l_compile(lua_State *L)
+{
+    const char *pattern = luaL_checkstring(L, 1);
+    char error[ERROR_BUFFER_LENGTH];
+
+    pattern_ud_t *ud = (pattern_ud_t *)lua_newuserdata(L, sizeof(pattern_ud_t));
+    ud->compiled = NULL;
+    luaL_setmetatable(L, PATTERN_METATABLE);
+
+    if (dtf_compile(pattern, &ud->compiled, error))
+    {
+        return luaL_error(L, "%s", error);
+    }
+
+    return 1;
+}
+
+static int l_compile_strftime(lua_State *L)
+{
+    const char *format = luaL_checkstring(L, 1);
+    char error[ERROR_BUFFER_LENGTH];
+
+    pattern_ud_t *ud = (pattern_ud_t *)lua_newuserdata(L, sizeof(pattern_ud_t));
+    ud->compiled = NULL;
+    luaL_setmetatable(L, PATTERN_METATABLE);
+
+    if (dtf_compile_strftime(format, &ud->compiled, error))
+    {
+        return luaL_error(L, "%s", error);
+    }
+
+    return 1;
+}
+
+static int l_format(lua_State *L)
+{
+    buffer_t *compiled = check_pattern(L, 1);
+    time_t timer = (time_t)luaL_optinteger(L, 2, time(NULL));
+    const char *locale = luaL_optstring(L, 3, "");
+    int offset = (int)luaL_optinteger(L, 4, 0);
+    const char *timezone = luaL_optstring(L, 5, "GMT");
+    int local = lua_toboolean(L, 6);
+
+    char error[ERROR_BUFFER_LENGTH];
+    strbuffer_t b;
+    init_strbuffer(&b);
+
+    if (dtf_formatb(compiled, timer, locale, offset, timezone, local, &b, error))
+    {
+        free_strbuffer(&b);
+        return luaL_error(L, "%s", error);
+    }
+
+    lua_pushlstring(L, b.buffer, b.length);
+    free_strbuffer(&b);
+
+    return 1;
+}
+
+// A drop-in for os.date: the formats are compiled once and cached in the
+// first upvalue, "*t", "!*t" and the conversions the strftime front end
+// doesn't support are handed to the os.date kept in the second upvalue.
+// The third upvalue counts the cached formats, the cache is emptied when
+// it holds DATE_CACHE_SIZE of them.
+static int l_date(lua_State *L)
+{
+    const char *format = luaL_optstring(L, 1, "%c");
+    time_t timer = (time_t)luaL_optinteger(L, 2, time(NULL));
+    int utc = format[0] == '!';
+    const char *body = utc ? format + 1 : format;
+
+    if (strncmp(body, "*t", 2) != 0)
+    {
+        lua_pushstring(L, body);
+        if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TNIL)
+        {
+            char error[ERROR_BUFFER_LENGTH];
+            buffer_t *compiled = NULL;
+
+            lua_pop(L, 1);
+
+            lua_Integer cached = lua_tointeger(L, lua_upvalueindex(3));
+            if (cached >= DATE_CACHE_SIZE)
+            {
+                lua_newtable(L);
+                lua_replace(L, lua_upvalueindex(1));
+                cached = 0;
+            }
+            lua_pushinteger(L, cached + 1);
+            lua_replace(L, lua_upvalueindex(3));
+
+            lua_pushstring(L, body);
+            if (dtf_compile_strftime(body, &compiled, error))
+            {
+                lua_pushboolean(L, 0);
+            }
+            else
+            {
+                pattern_ud_t *ud = (pattern_ud_t *)lua_newuserdata(L, sizeof(pattern_ud_t));
+                ud->compiled = compiled;
+                luaL_setmetatable(L, PATTERN_METATABLE);
+            }
+            lua_pushvalue(L, -1);
+            lua_insert(L, -3);
+            lua_rawset(L, lua_upvalueindex(1));
+        }
+
+        if (lua_toboolean(L, -1))
+        {
+            buffer_t *compiled = check_pattern(L, -1);
+            const char *locale = setlocale(LC_TIME, NULL);
+            char error[ERROR_BUFFER_LENGTH];
+            strbuffer_t b;
+            init_strbuffer(&b);
+
+            if (dtf_formatb(compiled, timer, locale != NULL ? locale : "C", 0, "GMT", !utc, &b, error))
+            {
+                free_strbuffer(&b);
+                return luaL_error(L, "%s", error);
+            }
+
+            lua_pushlstring(L, b.buffer, b.length);
+            free_strbuffer(&b);
+
+            return 1;
+        }
+        lua_pop(L, 1);
+    }
+
+    if (lua_isnil(L, lua_upvalueindex(2)))
+    {
+        return luaL_error(L, "the format \"%s\" needs os.date, that isn't loaded", format);
+    }
+
+    int n = lua_gettop(L);
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_insert(L, 1);
+    lua_call(L, n, 1);
+
+    return 1;
+}
+
+static const struct luaL_Reg pattern_methods[] = {
+    {"format", l_format},
+    {"__gc", l_pattern_gc},
+    {NULL, NULL} /* sentinel */
+};
+
+static const struct luaL_Reg datetimeformatter_functions[] = {
+    {"compile", l_compile},
+    {"compile_strftime", l_compile_strftime},
+    {"format", l_format},
+    {NULL, NULL} /* sentinel */
+};
+
+int luaopen_libdatetimeformatterlua(lua_State *L)
+{
+    luaL_newmetatable(L, PATTERN_METATABLE);
+    luaL_setfuncs(L, pattern_methods, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, datetimeformatter_functions);
+
+    lua_newtable(L);
+    lua_getglobal(L, "os");
+    if (lua_istable(L, -1))
+    {
+        lua_getfield(L, -1, "date");
+        lua_remove(L, -2);
+    }
+    else
+    {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, l_date, 3);
+    lua_setfield(L, -2, "date");
+
+    return 1;
+}
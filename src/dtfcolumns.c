@@ -0,0 +1,320 @@
+// dtfcolumns: formats a binary column of native int64 epochs into a text
+// column, one timestamp per line, using a compiled pattern.
+//
+// The input is mmapped and split in rounds of ROUND_ROWS rows per thread;
+// every thread formats its slice into its own chunk while the chunks of
+// the previous round are written in order with large sequential writes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "datetimeformatter.h"
+
+#define ROUND_ROWS (1 << 20)
+#define MAX_THREADS 256
+
+typedef struct settings_s
+{
+    buffer_t *compiled;
+    const char *locale;
+    int offset;
+    const char *timezone;
+    int local;
+    long units_per_second;
+} settings_t;
+
+typedef struct worker_s
+{
+    pthread_t thread;
+    const settings_t *settings;
+    const int64_t *values;
+    size_t begin, end;
+    strbuffer_t chunk;
+    int failed;
+    char error[ERROR_BUFFER_LENGTH];
+} worker_t;
+
+static void *format_slice(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    const settings_t *s = w->settings;
+    long ups = s->units_per_second;
+
+    w->chunk.length = 0;
+    w->failed = 0;
+
+    for (size_t i = w->begin; i < w->end; i++)
+    {
+        int64_t v = w->values[i];
+        int64_t seconds = v / ups, units = v % ups;
+        if (units < 0)
+        {
+            seconds--;
+            units += ups;
+        }
+
+        if (dtf_formatbn(s->compiled, (time_t)seconds, (long)(units * (NANOS_PER_SECOND / ups)),
+                         s->locale, s->offset, s->timezone, s->local, &w->chunk, w->error))
+        {
+            w->failed = 1;
+            break;
+        }
+
+        add_strchar(&w->chunk, '\n');
+    }
+
+    return NULL;
+}
+
+static int write_all(int fd, const char *b, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, b, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        b += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s -p pattern [-u s|ms|us|ns] [-t threads] [-l locale]\n"
+            "          [-o offset] [-z zone] [-L] input [output]\n"
+            "\n"
+            "Formats a binary file of native int64 epochs as text, one per line.\n"
+            "  -p  the date/time pattern, e.g. \"yyyy-MM-dd'T'HH:mm:ss.SSSXXX\"\n"
+            "  -u  unit of the epochs, seconds by default\n"
+            "  -t  number of threads, the online processors by default\n"
+            "  -l  locale of the names, \"C\" by default\n"
+            "  -o  zone offset in seconds east of UTC, 0 by default\n"
+            "  -z  zone name printed by 'z', \"UTC\" by default\n"
+            "  -L  use the local time zone of the process instead of -o and -z\n",
+            program);
+}
+
+int main(int argc, char **argv)
+{
+    const char *pattern = NULL;
+    settings_t settings = {NULL, "C", 0, "UTC", 0, 1};
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char error[ERROR_BUFFER_LENGTH];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:u:t:l:o:z:Lh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            pattern = optarg;
+            break;
+        case 'u':
+            if (strcmp(optarg, "s") == 0)
+                settings.units_per_second = 1;
+            else if (strcmp(optarg, "ms") == 0)
+                settings.units_per_second = 1000;
+            else if (strcmp(optarg, "us") == 0)
+                settings.units_per_second = 1000000;
+            else if (strcmp(optarg, "ns") == 0)
+                settings.units_per_second = NANOS_PER_SECOND;
+            else
+            {
+                fprintf(stderr, "unknown unit \"%s\"\n", optarg);
+                return 2;
+            }
+            break;
+        case 't':
+            nthreads = atol(optarg);
+            break;
+        case 'l':
+            settings.locale = optarg;
+            break;
+        case 'o':
+            settings.offset = atoi(optarg);
+            break;
+        case 'z':
+            settings.timezone = optarg;
+            break;
+        case 'L':
+            settings.local = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (pattern == NULL || optind >= argc)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+
+    if (dtf_compile(pattern, &settings.compiled, error))
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+
+    int in = open(argv[optind], O_RDONLY);
+    if (in < 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    int out = STDOUT_FILENO;
+    if (optind + 1 < argc)
+    {
+        out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0)
+        {
+            perror(argv[optind + 1]);
+            return 1;
+        }
+    }
+
+    struct stat st;
+    if (fstat(in, &st) < 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    size_t n = st.st_size / sizeof(int64_t);
+    const int64_t *values = NULL;
+
+    if (n > 0)
+    {
+        values = (const int64_t *)mmap(NULL, n * sizeof(int64_t), PROT_READ, MAP_PRIVATE, in, 0);
+        if (values == MAP_FAILED)
+        {
+            perror("mmap");
+            return 1;
+        }
+        madvise((void *)values, n * sizeof(int64_t), MADV_SEQUENTIAL);
+    }
+
+    // Two sets of workers: one formats a round while the other's chunks are written.
+    worker_t *workers = (worker_t *)calloc(2 * nthreads, sizeof(worker_t));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "Out of memory for %ld workers.\n", 2 * nthreads);
+        return 1;
+    }
+    for (long t = 0; t < 2 * nthreads; t++)
+    {
+        workers[t].settings = &settings;
+        workers[t].values = values;
+        init_strbuffer(&workers[t].chunk);
+    }
+
+    double start = now_seconds();
+    size_t written = 0, rows = 0, next = 0;
+    int failed = 0, round = 0, pending = 0;
+
+    while ((next < n || pending) && !failed)
+    {
+        worker_t *current = workers + (round % 2) * nthreads;
+        worker_t *previous = workers + ((round + 1) % 2) * nthreads;
+        int launched = 0;
+
+        for (long t = 0; t < nthreads && next < n; t++)
+        {
+            current[t].begin = next;
+            current[t].end = next + ROUND_ROWS < n ? next + ROUND_ROWS : n;
+            next = current[t].end;
+            if (pthread_create(&current[t].thread, NULL, format_slice, current + t) != 0)
+            {
+                fprintf(stderr, "Impossible to start a formatting thread.\n");
+                failed = 1;
+                break;
+            }
+            launched++;
+        }
+
+        for (int t = 0; t < pending; t++)
+        {
+            pthread_join(previous[t].thread, NULL);
+            if (previous[t].failed)
+            {
+                fprintf(stderr, "%s\n", previous[t].error);
+                failed = 1;
+            }
+            else if (!failed)
+            {
+                if (write_all(out, previous[t].chunk.buffer, previous[t].chunk.length))
+                {
+                    perror("write");
+                    failed = 1;
+                }
+                else
+                {
+                    written += previous[t].chunk.length;
+                    rows += previous[t].end - previous[t].begin;
+                }
+            }
+        }
+
+        pending = launched;
+        round++;
+    }
+
+    for (int t = 0; failed && t < pending; t++)
+    {
+        pthread_join(workers[(round + 1) % 2 * nthreads + t].thread, NULL);
+    }
+
+    double elapsed = now_seconds() - start;
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+
+    // Only what was written counts, the rest of the input after an error.
+    fprintf(stderr, "%zu rows, %.1f MB in, %.1f MB out in %.3f s: %.1f Mrows/s, %.1f MB/s out\n",
+            rows, rows * sizeof(int64_t) / 1e6, written / 1e6, elapsed,
+            rows / elapsed / 1e6, written / elapsed / 1e6);
+
+    for (long t = 0; t < 2 * nthreads; t++)
+    {
+        free_strbuffer(&workers[t].chunk);
+    }
+    free(workers);
+
+    if (n > 0)
+        munmap((void *)values, n * sizeof(int64_t));
+    close(in);
+    if (out != STDOUT_FILENO)
+        close(out);
+    free_buffer(settings.compiled);
+
+    return failed;
+}
@@ -0,0 +1,174 @@
+// dtffuzz: compiles random patterns and feeds random texts and columns to
+// the library, to be built with the address and undefined behavior
+// sanitizers, that report leaks and bad accesses when it exits.
+//
+//   dtffuzz [iterations [seed]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "datetimeformatter.h"
+
+// Pattern letters, quotes, strftime conversions, separators and bytes of
+// UTF-8 sequences, whole or cut.
+static const char alphabet[] = "GyMdkHmsSEDFwWahKzZYuXLQqbB'' :-./,%Tt\xc3\xa9\x80 ";
+
+#define FUZZ_PATTERN_LENGTH 600
+#define FUZZ_COLUMN_LENGTH 64
+
+static void random_pattern(char *pattern, int length)
+{
+    for (int k = 0; k < length; k++)
+    {
+        pattern[k] = alphabet[rand() % (sizeof(alphabet) - 1)];
+    }
+    pattern[length] = '\0';
+}
+
+static int fuzz_compiled(buffer_t *compiled, const char *pattern)
+{
+    char error[ERROR_BUFFER_LENGTH];
+    strbuffer_t b;
+    parsed_t parsed;
+    dtf_pattern_info_t info;
+
+    error[0] = '\0';
+    init_strbuffer(&b);
+    if (dtf_formatb(compiled, 1234567890, "C", 3600, "GMT", 0, &b, error) == 0)
+    {
+        // What was formatted, then the same text cut and with a byte changed.
+        dtf_parse(compiled, b.buffer, b.length, "C", 3600, "GMT", 0, &parsed, error);
+        if (b.length > 0)
+        {
+            dtf_parse(compiled, b.buffer, (size_t)rand() % b.length, "C", 3600, "GMT", 0, &parsed, error);
+            b.buffer[(size_t)rand() % b.length] = alphabet[rand() % (sizeof(alphabet) - 1)];
+            dtf_parse(compiled, b.buffer, b.length, "C", 3600, "GMT", 0, &parsed, error);
+        }
+    }
+    free_strbuffer(&b);
+
+    dtf_pattern_info(compiled, &info, error);
+
+    // Random bytes as a column of every encoding.
+    unsigned char column[FUZZ_COLUMN_LENGTH];
+    size_t size = (size_t)rand() % FUZZ_COLUMN_LENGTH, n;
+    dtf_formatter_t f = {compiled, "C", 0, "UTC", 0};
+
+    for (size_t k = 0; k < size; k++)
+    {
+        column[k] = (unsigned char)rand();
+    }
+
+    for (int encoding = DTF_COLUMN_DELTA; encoding <= DTF_COLUMN_FOR; encoding++)
+    {
+        init_strbuffer(&b);
+        dtf_format_column(&f, encoding, column, size, 1000, '\n', &b, &n, error);
+        free_strbuffer(&b);
+    }
+
+    dtf_bucketer_t bucketer;
+    if (dtf_bucketer_init(&f, &bucketer, error) == 0)
+    {
+        int64_t key;
+        dtf_bucket_key(&bucketer, (time_t)rand() * 1000, 0, &key);
+        init_strbuffer(&b);
+        dtf_bucket_format(&bucketer, key, &b, error);
+        free_strbuffer(&b);
+    }
+
+    if (strlen(error) >= ERROR_BUFFER_LENGTH)
+    {
+        printf("Unterminated error for [%s].\n", pattern);
+        return 1;
+    }
+    return 0;
+}
+
+static int fuzz_pattern(const char *pattern, int length)
+{
+    char error[ERROR_BUFFER_LENGTH];
+    buffer_t *compiled = NULL;
+    dtf_status_t status;
+
+    if (dtf_compile_status(pattern, &compiled, &status) == 0)
+    {
+        int failed = fuzz_compiled(compiled, pattern);
+        free_buffer(compiled);
+        if (failed)
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        char message[16];
+        size_t needed = dtf_status_message(&status, message, sizeof(message));
+
+        if (needed >= sizeof(message) && strlen(message) != sizeof(message) - 1)
+        {
+            printf("Message not cut at the size of the buffer for [%s].\n", pattern);
+            return 1;
+        }
+        if (status.position < 0 || status.position > length)
+        {
+            printf("Position %d out of [%s].\n", status.position, pattern);
+            return 1;
+        }
+    }
+
+    if (dtf_compile(pattern, &compiled, error) == 0)
+        free_buffer(compiled);
+    if (dtf_compile_fixed(pattern, "C", &compiled, error) == 0)
+        free_buffer(compiled);
+    if (dtf_compile_strftime(pattern, &compiled, error) == 0)
+        free_buffer(compiled);
+
+    const char *patterns[2] = {pattern, "yyyy-MM-dd"};
+    dtf_matcher_t *matcher;
+    if (dtf_matcher_compile(patterns, 2, &matcher, error) == 0)
+    {
+        int which;
+        parsed_t parsed;
+        dtf_matcher_parse(matcher, pattern, (size_t)length, "C", 0, "UTC", 0, &which, &parsed, error);
+        dtf_matcher_free(matcher);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    char pattern[FUZZ_PATTERN_LENGTH + 1];
+    char error[ERROR_BUFFER_LENGTH];
+
+    srand(argc > 2 ? (unsigned)atol(argv[2]) : 9);
+
+    for (long i = 0; i < iterations; i++)
+    {
+        // Mostly short patterns, now and then long ones.
+        int length = rand() % (i % 100 == 0 ? FUZZ_PATTERN_LENGTH : 24);
+        random_pattern(pattern, length);
+
+        if (fuzz_pattern(pattern, length))
+        {
+            return 1;
+        }
+    }
+
+    // A locale name longer than any buffer.
+    char locale[5000];
+    buffer_t *compiled;
+    memset(locale, 'a', sizeof(locale) - 1);
+    locale[sizeof(locale) - 1] = '\0';
+    memcpy(locale, "xyz'", 4);
+    if (dtf_compile_fixed("EEE", locale, &compiled, error) == 0)
+    {
+        free_buffer(compiled);
+    }
+
+    printf("%ld patterns.\n", iterations);
+    return 0;
+}
@@ -0,0 +1,54 @@
+// dtflocales: renders the month, weekday, AM/PM and era names of some
+// locales once and dumps them in a versioned binary snapshot, that
+// dtf_locales_load maps read-only so startup doesn't call setlocale.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "datetimeformatter.h"
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s -o snapshot locale...\n"
+            "\n"
+            "Writes the names of the given locales to a snapshot for dtf_locales_load.\n"
+            "  -o  the snapshot file to write\n",
+            program);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = NULL;
+    char error[ERROR_BUFFER_LENGTH];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (path == NULL || optind >= argc)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (dtf_locales_dump(path, (const char **)argv + optind, argc - optind, error))
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+
+    return 0;
+}
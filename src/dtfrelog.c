@@ -0,0 +1,533 @@
+// dtfrelog: rewrites the timestamp of every line of a log from one
+// pattern to another, for example from "dd/MMM/yyyy:HH:mm:ss Z" to ISO.
+//
+// A reader thread reads chunks that end on line boundaries into a ring of
+// slots, worker threads parse every line with the input pattern and format
+// it again with the output one, and the writer, that is the main thread,
+// writes the slots back in the order they were read. Lines where the input
+// pattern matches nowhere within the scan window pass through untouched.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "datetimeformatter.h"
+
+#define CHUNK_SIZE (4 << 20)
+#define MAX_THREADS 256
+
+typedef enum slot_state
+{
+    SLOT_FREE,
+    SLOT_READ,
+    SLOT_BUSY,
+    SLOT_DONE,
+} slot_state_t;
+
+typedef struct slot_s
+{
+    slot_state_t state;
+    char *data;
+    size_t length, size;
+    strbuffer_t output;
+    size_t lines, matched;
+    int failed;
+    char error[ERROR_BUFFER_LENGTH];
+} slot_t;
+
+typedef struct settings_s
+{
+    buffer_t *input;
+    buffer_t *output;
+    const char *input_locale, *output_locale;
+    int input_offset, output_offset;
+    const char *input_timezone, *output_timezone;
+    int input_local, output_local;
+    int keep_offset; // format in the offset parsed from the line.
+    size_t window;   // bytes of each line where the timestamp may start.
+} settings_t;
+
+typedef struct pipeline_s
+{
+    const settings_t *settings;
+    int in;
+    slot_t *slots;
+    size_t nslots;
+    size_t next_read, next_work; // sequence numbers, the slot is seq % nslots.
+    int eof;
+    int read_failed;
+    int stop; // a thread couldn't be started, the others give up.
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+} pipeline_t;
+
+static int resize_slot(slot_t *slot, size_t size)
+{
+    // The data is kept if there is no memory for more.
+    char *data = (char *)realloc(slot->data, size);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Out of memory for a chunk of %zu bytes.\n", size);
+        return 1;
+    }
+    slot->data = data;
+    slot->size = size;
+    return 0;
+}
+
+static void *reader(void *arg)
+{
+    pipeline_t *p = (pipeline_t *)arg;
+    char *carry = NULL;
+    size_t carried = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&p->mutex);
+        slot_t *slot = p->slots + p->next_read % p->nslots;
+        while (slot->state != SLOT_FREE && !p->stop)
+        {
+            pthread_cond_wait(&p->changed, &p->mutex);
+        }
+        pthread_mutex_unlock(&p->mutex);
+
+        if (p->stop)
+        {
+            break;
+        }
+
+        int eof = 0, failed = 0;
+        char *newline = NULL;
+
+        // The partial line left by the previous chunk opens this one.
+        slot->length = 0;
+        if (slot->size < carried + CHUNK_SIZE && resize_slot(slot, carried + CHUNK_SIZE))
+        {
+            failed = eof = 1;
+        }
+        else
+        {
+            memcpy(slot->data, carry, carried);
+            slot->length = carried;
+        }
+
+        while (newline == NULL && !eof)
+        {
+            if (slot->length == slot->size && resize_slot(slot, slot->size * 2)) // a line longer than a chunk.
+            {
+                failed = eof = 1;
+                break;
+            }
+
+            ssize_t r = read(p->in, slot->data + slot->length, slot->size - slot->length);
+            if (r < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (r <= 0)
+            {
+                if (r < 0)
+                {
+                    perror("read");
+                    p->read_failed = 1;
+                }
+                eof = 1;
+                break;
+            }
+
+            slot->length += r;
+
+            if (slot->length < slot->size && !eof)
+            {
+                // Fill the chunk before looking for its last line boundary.
+                continue;
+            }
+
+            for (size_t k = slot->length; k > 0; k--)
+            {
+                if (slot->data[k - 1] == '\n')
+                {
+                    newline = slot->data + k - 1;
+                    break;
+                }
+            }
+        }
+
+        size_t used = newline != NULL ? (size_t)(newline - slot->data) + 1 : slot->length;
+        char *rest = (char *)realloc(carry, slot->length - used > 0 ? slot->length - used : 1);
+        if (rest == NULL)
+        {
+            fprintf(stderr, "Out of memory for a line of %zu bytes.\n", slot->length - used);
+            failed = eof = 1;
+        }
+        else
+        {
+            carry = rest;
+            carried = slot->length - used;
+            memcpy(carry, slot->data + used, carried);
+            slot->length = used;
+        }
+
+        pthread_mutex_lock(&p->mutex);
+        if (failed)
+        {
+            p->read_failed = 1;
+        }
+        if (slot->length > 0)
+        {
+            slot->state = SLOT_READ;
+            p->next_read++;
+        }
+        p->eof = eof;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->mutex);
+
+        if (eof)
+        {
+            break;
+        }
+    }
+
+    free(carry);
+    return NULL;
+}
+
+static int rewrite_line(const settings_t *s, const char *line, size_t length, strbuffer_t *out, char *error)
+{
+    size_t window = length < s->window ? length : s->window;
+    parsed_t parsed;
+
+    for (size_t start = 0; start < window; start++)
+    {
+        int matched = dtf_parse(s->input, line + start, length - start, s->input_locale,
+                                s->input_offset, s->input_timezone, s->input_local, &parsed, error);
+        if (matched < 0)
+        {
+            return -1;
+        }
+        if (matched == 0)
+        {
+            continue;
+        }
+
+        int offset = s->keep_offset ? parsed.zone_offset : s->output_offset;
+
+        add_lstring(out, line, start);
+        if (dtf_formatbn(s->output, parsed.timer, parsed.nanos, s->output_locale, offset,
+                         s->output_timezone, s->output_local, out, error))
+        {
+            return -1;
+        }
+        add_lstring(out, line + start + parsed.length, length - start - parsed.length);
+        return 1;
+    }
+
+    add_lstring(out, line, length);
+    return 0;
+}
+
+static void *worker(void *arg)
+{
+    pipeline_t *p = (pipeline_t *)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&p->mutex);
+        slot_t *slot = p->slots + p->next_work % p->nslots;
+        while (slot->state != SLOT_READ && !(p->eof && p->next_work == p->next_read) && !p->stop)
+        {
+            pthread_cond_wait(&p->changed, &p->mutex);
+            slot = p->slots + p->next_work % p->nslots; // another worker may have taken it.
+        }
+        if (slot->state != SLOT_READ || p->stop)
+        {
+            pthread_mutex_unlock(&p->mutex);
+            break;
+        }
+        slot->state = SLOT_BUSY;
+        p->next_work++;
+        pthread_mutex_unlock(&p->mutex);
+
+        slot->output.length = 0;
+        slot->lines = slot->matched = 0;
+        slot->failed = 0;
+
+        for (size_t begin = 0; begin < slot->length && !slot->failed;)
+        {
+            const char *line = slot->data + begin;
+            const char *newline = memchr(line, '\n', slot->length - begin);
+            size_t length = newline != NULL ? (size_t)(newline - line) : slot->length - begin;
+
+            int matched = rewrite_line(p->settings, line, length, &slot->output, slot->error);
+            if (matched < 0)
+            {
+                slot->failed = 1;
+            }
+
+            slot->matched += matched > 0;
+            slot->lines++;
+
+            if (newline != NULL)
+            {
+                add_strchar(&slot->output, '\n');
+                length++;
+            }
+            begin += length;
+        }
+
+        pthread_mutex_lock(&p->mutex);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->mutex);
+    }
+
+    return NULL;
+}
+
+static int write_all(int fd, const char *b, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, b, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        b += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s -i pattern -p pattern [-t threads] [-w window]\n"
+            "          [-l locale] [-o offset] [-z zone] [-L]\n"
+            "          [-I locale] [-O offset] [-Z zone] [-N] [input [output]]\n"
+            "\n"
+            "Rewrites the timestamp of every line from the -i pattern to the -p one.\n"
+            "  -t  number of worker threads, the online processors by default\n"
+            "  -w  bytes of each line where a timestamp may start, 256 by default\n"
+            "  -l, -o, -z, -L  locale, offset, zone name and local zone of the output\n"
+            "  -I, -O, -Z, -N  locale, offset, zone name and local zone of the input\n"
+            "Unless -o, -z or -L are given, the output keeps the offset of each line.\n",
+            program);
+}
+
+int main(int argc, char **argv)
+{
+    const char *input_pattern = NULL, *output_pattern = NULL;
+    settings_t settings = {NULL, NULL, "C", "C", 0, 0, "UTC", "UTC", 0, 0, 1, 256};
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char error[ERROR_BUFFER_LENGTH];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:p:t:w:l:o:z:LI:O:Z:Nh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            input_pattern = optarg;
+            break;
+        case 'p':
+            output_pattern = optarg;
+            break;
+        case 't':
+            nthreads = atol(optarg);
+            break;
+        case 'w':
+            settings.window = (size_t)atol(optarg);
+            break;
+        case 'l':
+            settings.output_locale = optarg;
+            break;
+        case 'o':
+            settings.output_offset = atoi(optarg);
+            settings.keep_offset = 0;
+            break;
+        case 'z':
+            settings.output_timezone = optarg;
+            settings.keep_offset = 0;
+            break;
+        case 'L':
+            settings.output_local = 1;
+            settings.keep_offset = 0;
+            break;
+        case 'I':
+            settings.input_locale = optarg;
+            break;
+        case 'O':
+            settings.input_offset = atoi(optarg);
+            break;
+        case 'Z':
+            settings.input_timezone = optarg;
+            break;
+        case 'N':
+            settings.input_local = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (input_pattern == NULL || output_pattern == NULL)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+
+    if (dtf_compile(input_pattern, &settings.input, error) || dtf_compile(output_pattern, &settings.output, error))
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+
+    pipeline_t p;
+    memset(&p, 0, sizeof(pipeline_t));
+    p.settings = &settings;
+    p.in = STDIN_FILENO;
+    p.nslots = 2 * nthreads + 2;
+    p.slots = (slot_t *)calloc(p.nslots, sizeof(slot_t));
+    if (p.slots == NULL)
+    {
+        fprintf(stderr, "Out of memory for %zu slots.\n", p.nslots);
+        return 1;
+    }
+    pthread_mutex_init(&p.mutex, NULL);
+    pthread_cond_init(&p.changed, NULL);
+
+    for (size_t k = 0; k < p.nslots; k++)
+    {
+        init_strbuffer(&p.slots[k].output);
+    }
+
+    if (optind < argc && (p.in = open(argv[optind], O_RDONLY)) < 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    int out = STDOUT_FILENO;
+    if (optind + 1 < argc && (out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    double start = now_seconds();
+
+    pthread_t reader_thread, workers[MAX_THREADS];
+    long started = 0;
+    int failed = 0, reading = pthread_create(&reader_thread, NULL, reader, &p) == 0;
+
+    while (reading && started < nthreads && pthread_create(workers + started, NULL, worker, &p) == 0)
+    {
+        started++;
+    }
+
+    if (!reading || started < nthreads)
+    {
+        fprintf(stderr, "Impossible to start the %s thread.\n", reading ? "worker" : "reader");
+        pthread_mutex_lock(&p.mutex);
+        p.stop = 1;
+        pthread_cond_broadcast(&p.changed);
+        pthread_mutex_unlock(&p.mutex);
+        failed = 1;
+    }
+
+    size_t read = 0, written = 0, lines = 0, matched = 0;
+
+    for (size_t next_write = 0; !p.stop; next_write++)
+    {
+        pthread_mutex_lock(&p.mutex);
+        slot_t *slot = p.slots + next_write % p.nslots;
+        while (slot->state != SLOT_DONE && !(p.eof && next_write == p.next_read))
+        {
+            pthread_cond_wait(&p.changed, &p.mutex);
+        }
+        pthread_mutex_unlock(&p.mutex);
+
+        if (slot->state != SLOT_DONE)
+        {
+            break;
+        }
+
+        if (slot->failed && !failed)
+        {
+            fprintf(stderr, "%s\n", slot->error);
+            failed = 1;
+        }
+        else if (!failed && write_all(out, slot->output.buffer, slot->output.length))
+        {
+            perror("write");
+            failed = 1;
+        }
+
+        read += slot->length;
+        written += slot->output.length;
+        lines += slot->lines;
+        matched += slot->matched;
+
+        pthread_mutex_lock(&p.mutex);
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&p.changed);
+        pthread_mutex_unlock(&p.mutex);
+    }
+
+    if (reading)
+    {
+        pthread_join(reader_thread, NULL);
+    }
+    for (long t = 0; t < started; t++)
+    {
+        pthread_join(workers[t], NULL);
+    }
+
+    double elapsed = now_seconds() - start;
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+
+    fprintf(stderr, "%zu lines, %zu rewritten, %.1f MB in, %.1f MB out in %.3f s: %.1f MB/s in\n",
+            lines, matched, read / 1e6, written / 1e6, elapsed, read / elapsed / 1e6);
+
+    for (size_t k = 0; k < p.nslots; k++)
+    {
+        free(p.slots[k].data);
+        free_strbuffer(&p.slots[k].output);
+    }
+    free(p.slots);
+    pthread_mutex_destroy(&p.mutex);
+    pthread_cond_destroy(&p.changed);
+
+    if (p.in != STDIN_FILENO)
+        close(p.in);
+    if (out != STDOUT_FILENO)
+        close(out);
+    free_buffer(settings.input);
+    free_buffer(settings.output);
+
+    return failed || p.read_failed;
+}
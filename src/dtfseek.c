@@ -0,0 +1,198 @@
+// dtfseek: finds the bytes of a log sorted by time that hold the lines of
+// a time window, by a binary search over the lines of the mmapped file,
+// and prints their offsets or copies them out.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "datetimeformatter.h"
+
+static int write_all(int fd, const char *b, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, b, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        b += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static int parse_bound(const dtf_formatter_t *f, const char *text, time_t *timer, char *error)
+{
+    // "@" and epoch seconds, or a timestamp in the pattern of the log.
+    parsed_t parsed;
+    char *end;
+
+    if (text[0] == '@')
+    {
+        *timer = (time_t)strtoll(text + 1, &end, 10);
+        if (end == text + 1 || *end != '\0')
+        {
+            snprintf(error, ERROR_BUFFER_LENGTH, "\"%s\" isn't a number of seconds.", text + 1);
+            return 1;
+        }
+        return 0;
+    }
+
+    int matched = dtf_parse(f->compiled, text, strlen(text), f->locale, f->offset, f->timezone, f->local, &parsed, error);
+    if (matched < 0)
+    {
+        return 1;
+    }
+    if (matched == 0 || parsed.length != strlen(text))
+    {
+        snprintf(error, ERROR_BUFFER_LENGTH, "\"%s\" doesn't match the pattern.", text);
+        return 1;
+    }
+
+    *timer = parsed.timer;
+    return 0;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s -p pattern -f from -t to [-w window] [-s skip]\n"
+            "          [-l locale] [-o offset] [-z zone] [-L] [-c] file\n"
+            "\n"
+            "Prints the byte range of the lines of a log sorted by time stamped in [from, to).\n"
+            "  -p  the pattern of the timestamps, e.g. \"dd/MMM/yyyy:HH:mm:ss Z\"\n"
+            "  -f, -t  the window, in the pattern or as @ and epoch seconds\n"
+            "  -w  bytes of each line where a timestamp may start, 256 by default\n"
+            "  -s  bytes of lines without a timestamp a probe skips at most, 1 MB by default\n"
+            "  -l, -o, -z, -L  locale, offset, zone name and local zone of the timestamps\n"
+            "  -c  copy the lines to the standard output instead of printing the range\n",
+            program);
+}
+
+int main(int argc, char **argv)
+{
+    const char *pattern = NULL, *from_text = NULL, *to_text = NULL;
+    dtf_formatter_t f = {NULL, "C", 0, "UTC", 0};
+    size_t window = 256, skip = 1 << 20;
+    int copy = 0;
+    char error[ERROR_BUFFER_LENGTH];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:f:t:w:s:l:o:z:Lch")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            pattern = optarg;
+            break;
+        case 'f':
+            from_text = optarg;
+            break;
+        case 't':
+            to_text = optarg;
+            break;
+        case 'w':
+            window = (size_t)atol(optarg);
+            break;
+        case 's':
+            skip = (size_t)atol(optarg);
+            break;
+        case 'l':
+            f.locale = optarg;
+            break;
+        case 'o':
+            f.offset = atoi(optarg);
+            break;
+        case 'z':
+            f.timezone = optarg;
+            break;
+        case 'L':
+            f.local = 1;
+            break;
+        case 'c':
+            copy = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (pattern == NULL || from_text == NULL || to_text == NULL || optind + 1 != argc)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    time_t from, to;
+
+    if (dtf_compile(pattern, &f.compiled, error) ||
+        parse_bound(&f, from_text, &from, error) || parse_bound(&f, to_text, &to, error))
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+
+    int in = open(argv[optind], O_RDONLY);
+    struct stat st;
+
+    if (in < 0 || fstat(in, &st) < 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    size_t size = st.st_size, begin = 0, end = 0;
+    const char *data = NULL;
+
+    if (size > 0)
+    {
+        data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+        if (data == MAP_FAILED)
+        {
+            perror("mmap");
+            return 1;
+        }
+        madvise((void *)data, size, MADV_RANDOM);
+    }
+
+    int failed = dtf_seek(&f, data, size, window, skip, from, to, &begin, &end, error);
+
+    if (failed)
+    {
+        fprintf(stderr, "%s\n", error);
+    }
+    else if (copy)
+    {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE), aligned = begin / page * page;
+        madvise((void *)(data + aligned), end - aligned, MADV_SEQUENTIAL);
+        if (write_all(STDOUT_FILENO, data + begin, end - begin))
+        {
+            perror("write");
+            failed = 1;
+        }
+    }
+    else
+    {
+        printf("%zu %zu\n", begin, end);
+    }
+
+    if (size > 0)
+        munmap((void *)data, size);
+    close(in);
+    free_buffer(f.compiled);
+
+    return failed;
+}
@@ -0,0 +1,272 @@
+// dtftest: checks outputs the library promises, exits with the number of
+// failed checks.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "datetimeformatter.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                  \
+    do                                                                    \
+    {                                                                     \
+        if (!(condition))                                                 \
+        {                                                                 \
+            printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                   \
+        }                                                                 \
+    } while (0)
+
+static void set_zone(const char *zone)
+{
+    setenv("TZ", zone, 1);
+    dtf_zone_reset();
+}
+
+// The text of the bucket of a key, in a static buffer.
+static const char *bucket_text(const dtf_bucketer_t *bucketer, int64_t key)
+{
+    static char text[ERROR_BUFFER_LENGTH + 8];
+    char error[ERROR_BUFFER_LENGTH];
+    strbuffer_t b;
+
+    init_strbuffer(&b);
+    if (dtf_bucket_format(bucketer, key, &b, error))
+    {
+        snprintf(text, sizeof(text), "error: %s", error);
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "%.*s", (int)b.length, b.buffer);
+    }
+    free_strbuffer(&b);
+    return text;
+}
+
+// The instant of midnight UTC of a date.
+static time_t utc_date(int year, int month, int day)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month - 1;
+    tm.tm_mday = day;
+    return dtf_timegm(&tm);
+}
+
+static void test_short_years(void)
+{
+    char error[ERROR_BUFFER_LENGTH], text[64];
+    buffer_t *compiled;
+    dtf_pattern_info_t info;
+
+    // "yy" clips years in 1000..9999 only.
+    CHECK(dtf_compile("yy", &compiled, error) == 0);
+    CHECK(dtf_pattern_info(compiled, &info, error) == 0);
+    CHECK(!info.fixed_width);
+    CHECK(info.min_length == 2 && info.max_length == 3);
+
+    const struct
+    {
+        int year;
+        const char *text;
+    } years[] = {{5, "05"}, {99, "99"}, {132, "132"}, {999, "999"}, {1000, "00"}, {2023, "23"}, {9999, "99"}};
+
+    for (size_t i = 0; i < sizeof(years) / sizeof(years[0]); i++)
+    {
+        CHECK(dtf_format(compiled, utc_date(years[i].year, 6, 1), "C", 0, "UTC", 0, text) == 0);
+        CHECK(strcmp(text, years[i].text) == 0);
+        CHECK(strlen(text) >= info.min_length && strlen(text) <= info.max_length);
+    }
+    free_buffer(compiled);
+}
+
+static void test_fixed_years(void)
+{
+    char error[ERROR_BUFFER_LENGTH];
+    dtf_formatter_t f = {NULL, "C", 0, "UTC", 0};
+    int64_t values[] = {utc_date(132, 8, 15), utc_date(2023, 8, 15), utc_date(9999, 12, 31)};
+    char records[3 * 16 + 1];
+    size_t width;
+
+    // "yy" is padded to four digits like the other years.
+    CHECK(dtf_compile_fixed("yy-MM-dd", "C", &f.compiled, error) == 0);
+    CHECK(dtf_format_fixed(&f, values, 3, 1, records, &width, error) == 0);
+    CHECK(width == 10);
+    records[3 * width] = '\0';
+    CHECK(strcmp(records, "0132-08-152023-08-159999-12-31") == 0);
+
+    // Years past 9999 don't fit.
+    values[0] = utc_date(11476, 8, 15);
+    CHECK(dtf_format_fixed(&f, values, 1, 1, records, &width, error) == 1);
+    free_buffer(f.compiled);
+}
+
+static void test_buckets(void)
+{
+    char error[ERROR_BUFFER_LENGTH];
+    dtf_formatter_t f = {NULL, "C", 0, "UTC", 1};
+    dtf_bucketer_t bucketer;
+    int64_t edt, est, later;
+
+    set_zone("America/New_York");
+
+    // 01:30 EDT and, an hour later, 01:30 EST: two buckets.
+    CHECK(dtf_compile("yyyy-MM-dd HH z", &f.compiled, error) == 0);
+    CHECK(dtf_bucketer_init(&f, &bucketer, error) == 0);
+    dtf_bucket_key(&bucketer, 1699162200, 0, &edt);
+    dtf_bucket_key(&bucketer, 1699165800, 0, &est);
+    dtf_bucket_key(&bucketer, 1699165800 + 1200, 0, &later);
+    CHECK(edt != est);
+    CHECK(est == later);
+    CHECK(strcmp(bucket_text(&bucketer, edt), "2023-11-05 01 EDT") == 0);
+    CHECK(strcmp(bucket_text(&bucketer, est), "2023-11-05 01 EST") == 0);
+    free_buffer(f.compiled);
+
+    // Keys with the offset only tell buckets apart: the same text before and
+    // after the summer has one key.
+    CHECK(dtf_compile("yyyy z", &f.compiled, error) == 0);
+    CHECK(dtf_bucketer_init(&f, &bucketer, error) == 0);
+    dtf_bucket_key(&bucketer, 1673000000, 0, &edt);   // January
+    dtf_bucket_key(&bucketer, 1702000000, 0, &later); // December
+    CHECK(edt == later);
+    CHECK(strcmp(bucket_text(&bucketer, later), "2023 EST") == 0);
+    free_buffer(f.compiled);
+
+    // Without a printed zone the keys follow local time.
+    CHECK(dtf_compile("yyyy-MM-dd HH", &f.compiled, error) == 0);
+    CHECK(dtf_bucketer_init(&f, &bucketer, error) == 0);
+    dtf_bucket_key(&bucketer, 1699162200, 0, &edt);
+    dtf_bucket_key(&bucketer, 1699165800, 0, &est);
+    CHECK(edt == est);
+    free_buffer(f.compiled);
+
+    set_zone("UTC");
+
+    // Fields that change in the middle of the period of the finest one.
+    const char *rejected[] = {"yyyy-MM-dd a", "YYYY-ww", "yyyy-MM F", "YYYY", "YYYY-MM"};
+    for (size_t i = 0; i < sizeof(rejected) / sizeof(rejected[0]); i++)
+    {
+        CHECK(dtf_compile(rejected[i], &f.compiled, error) == 0);
+        CHECK(dtf_bucketer_init(&f, &bucketer, error) == 1);
+        free_buffer(f.compiled);
+    }
+
+    // Fixed offsets: monotonic keys, one per hour.
+    f.local = 0;
+    CHECK(dtf_compile("yyyy-MM-dd hh a", &f.compiled, error) == 0);
+    CHECK(dtf_bucketer_init(&f, &bucketer, error) == 0);
+    dtf_bucket_key(&bucketer, 1699963200, 0, &edt);
+    dtf_bucket_key(&bucketer, 1699963200 + 3600, 0, &later);
+    CHECK(later == edt + 1);
+    CHECK(strcmp(bucket_text(&bucketer, later), "2023-11-14 01 PM") == 0);
+    free_buffer(f.compiled);
+}
+
+static void test_format_many(void)
+{
+    char error[ERROR_BUFFER_LENGTH];
+    dtf_formatter_t targets[5];
+    const int zones[] = {0, 3600, -3600, 50400, -43200};
+    strbuffer_t data;
+    int64_t offsets[6];
+
+    // Each offset moves the UTC date by at most a day, across the ends of
+    // months, of leap and common Februaries and of years.
+    const struct
+    {
+        time_t timer;
+        const char *text;
+    } instants[] = {
+        {utc_date(2023, 12, 31) + 86399, "2023-12-31 23:59|2024-01-01 00:59|2023-12-31 22:59|2024-01-01 13:59|2023-12-31 11:59|"},
+        {utc_date(2024, 3, 1) + 1800, "2024-03-01 00:30|2024-03-01 01:30|2024-02-29 23:30|2024-03-01 14:30|2024-02-29 12:30|"},
+        {utc_date(1900, 3, 1), "1900-03-01 00:00|1900-03-01 01:00|1900-02-28 23:00|1900-03-01 14:00|1900-02-28 12:00|"},
+        {utc_date(2023, 3, 1), "2023-03-01 00:00|2023-03-01 01:00|2023-02-28 23:00|2023-03-01 14:00|2023-02-28 12:00|"},
+        {utc_date(1999, 12, 31) + 50000, "1999-12-31 13:53|1999-12-31 14:53|1999-12-31 12:53|2000-01-01 03:53|1999-12-31 01:53|"},
+    };
+    buffer_t *compiled;
+
+    CHECK(dtf_compile("yyyy-MM-dd HH:mm|", &compiled, error) == 0);
+    for (int i = 0; i < 5; i++)
+    {
+        dtf_formatter_t target = {compiled, "C", zones[i], "", 0};
+        targets[i] = target;
+    }
+    for (size_t k = 0; k < sizeof(instants) / sizeof(instants[0]); k++)
+    {
+        init_strbuffer(&data);
+        CHECK(dtf_format_many(targets, 5, instants[k].timer, 0, &data, offsets, error) == 0);
+        CHECK(offsets[5] == (int64_t)strlen(instants[k].text) &&
+              memcmp(data.buffer, instants[k].text, data.length) == 0);
+        free_strbuffer(&data);
+    }
+    free_buffer(compiled);
+}
+
+static void test_hour_and_weekday_letters(void)
+{
+    char error[ERROR_BUFFER_LENGTH], text[64];
+    buffer_t *compiled;
+    dtf_formatter_t f = {NULL, "C", 0, "UTC", 0};
+    const time_t monday = utc_date(2024, 1, 1);
+
+    // 'k' is 1..24 and 'h' 1..12: midnight is 24 and 12, noon is 12.
+    CHECK(dtf_compile("kk hh a", &compiled, error) == 0);
+    CHECK(dtf_format(compiled, monday, "C", 0, "UTC", 0, text) == 0);
+    CHECK(strcmp(text, "24 12 AM") == 0);
+    CHECK(dtf_format(compiled, monday + 12 * 3600, "C", 0, "UTC", 0, text) == 0);
+    CHECK(strcmp(text, "12 12 PM") == 0);
+    CHECK(dtf_format(compiled, monday + 13 * 3600, "C", 0, "UTC", 0, text) == 0);
+    CHECK(strcmp(text, "13 01 PM") == 0);
+    free_buffer(compiled);
+
+    // 'u' is the ISO day of week, Monday 1 to Sunday 7.
+    CHECK(dtf_compile("u", &compiled, error) == 0);
+    for (int day = 0; day < 7; day++)
+    {
+        char expected[2] = {(char)('1' + day), '\0'};
+        CHECK(dtf_format(compiled, monday + day * 86400, "C", 0, "UTC", 0, text) == 0);
+        CHECK(strcmp(text, expected) == 0);
+    }
+    free_buffer(compiled);
+
+    // The same values packed by the fixed width formatter.
+    int64_t values[] = {monday, monday + 6 * 86400 + 12 * 3600};
+    char records[2 * 5 + 1];
+    size_t width;
+    CHECK(dtf_compile_fixed("kkhhu", "C", &f.compiled, error) == 0);
+    CHECK(dtf_format_fixed(&f, values, 2, 1, records, &width, error) == 0);
+    CHECK(width == 5);
+    records[2 * width] = '\0';
+    CHECK(strcmp(records, "24121" "12127") == 0);
+    free_buffer(f.compiled);
+
+    // strftime's %I and %u are these letters.
+    int failed = dtf_compile_strftime("%I %u", &compiled, error);
+    CHECK(failed == 0);
+    if (!failed)
+    {
+        CHECK(dtf_format(compiled, monday + 6 * 86400, "C", 0, "UTC", 0, text) == 0);
+        CHECK(strcmp(text, "12 7") == 0);
+        free_buffer(compiled);
+    }
+}
+
+int main(void)
+{
+    test_short_years();
+    test_fixed_years();
+    test_buckets();
+    test_format_many();
+    test_hour_and_weekday_letters();
+
+    if (failures == 0)
+    {
+        printf("All checks passed.\n");
+    }
+    return failures;
+}